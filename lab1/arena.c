@@ -0,0 +1,132 @@
+/**
+ * @brief: bump allocator, see arena.h
+ * NOTES: an allocation bigger than a quarter block that doesn't fit in
+ *        the current block gets a block of its own, linked behind the
+ *        current one, so the rest of the current block is not wasted.
+ *        An arena whose block_size covers everything it will hold makes
+ *        exactly one malloc().
+ */
+
+#include <stdlib.h>   /* for malloc(), free() */
+#include <string.h>   /* for memset(), memcpy() */
+#include "arena.h"
+
+/**
+ * @brief: start an empty arena, nothing is allocated until the first use
+ * @param: p_a struct arena* the arena
+ * @param: block_size size_t bytes per block, 0 for ARENA_BLOCK
+ */
+void arena_init(struct arena *p_a, size_t block_size)
+{
+    p_a->head = NULL;
+    p_a->block_size = block_size ? block_size : ARENA_BLOCK;
+    p_a->nallocs = 0;
+    p_a->nblocks = 0;
+}
+
+/**
+ * @brief: allocate size bytes, aligned to ARENA_ALIGN
+ * @return the memory, not zeroed; NULL if malloc() fails
+ */
+void *arena_alloc(struct arena *p_a, size_t size)
+{
+    struct arena_block *b = p_a->head;
+    size_t need = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (need == 0) {
+        need = ARENA_ALIGN;
+    }
+    p_a->nallocs++;
+    if (b != NULL && b->size - b->used >= need) {
+        b->used += need;
+        return b->data + b->used - need;
+    }
+    if (b != NULL && need > p_a->block_size / 4) {
+        /* a block of its own, slotted in behind the current one */
+        b = malloc(sizeof(struct arena_block) + need);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->size = need;
+        b->used = need;
+        b->next = p_a->head->next;
+        p_a->head->next = b;
+        p_a->nblocks++;
+        return b->data;
+    }
+    size = (need > p_a->block_size) ? need : p_a->block_size;
+    b = malloc(sizeof(struct arena_block) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->size = size;
+    b->used = need;
+    b->next = p_a->head;
+    p_a->head = b;
+    p_a->nblocks++;
+    return b->data;
+}
+
+/**
+ * @brief: allocate size zeroed bytes
+ */
+void *arena_calloc(struct arena *p_a, size_t size)
+{
+    void *p = arena_alloc(p_a, size);
+
+    if (p != NULL) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+/**
+ * @brief: copy size bytes from src into the arena
+ */
+void *arena_dup(struct arena *p_a, const void *src, size_t size)
+{
+    void *p = arena_alloc(p_a, size);
+
+    if (p != NULL && size > 0) {
+        memcpy(p, src, size);
+    }
+    return p;
+}
+
+/**
+ * @brief: free everything allocated from the arena, which can be used
+ *         again afterwards
+ */
+void arena_release(struct arena *p_a)
+{
+    struct arena_block *b = p_a->head;
+
+    while (b != NULL) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    p_a->head = NULL;
+}
+
+/**
+ * @brief: free everything allocated from the arena but keep its newest
+ *         block, so an arena that is filled and emptied over and over
+ *         only calls malloc() the first time
+ */
+void arena_reset(struct arena *p_a)
+{
+    struct arena_block *b;
+
+    if (p_a->head == NULL) {
+        return;
+    }
+    b = p_a->head->next;
+    while (b != NULL) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    p_a->head->next = NULL;
+    p_a->head->used = 0;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file: arena.h
+ * @brief: bump allocator for short lived, many-piece state (chunk headers,
+ *         kept chunks, plans) that is all released together
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define ARENA_BLOCK (64 * 1024) /* default block size                     */
+#define ARENA_ALIGN 16          /* every allocation is aligned to this    */
+
+/* one malloc'd block, allocations are carved off its end of use */
+struct arena_block {
+    struct arena_block *next;   /* block allocated before this one        */
+    size_t size;                /* bytes in data                          */
+    size_t used;                /* bytes of data handed out               */
+    size_t pad;                 /* header is 4 words: data stays aligned  */
+    unsigned char data[];
+};
+
+/* a list of blocks; arena_release() frees them all in one go */
+typedef struct arena {
+    struct arena_block *head;   /* current block, NULL before the first   */
+    size_t block_size;          /* size of a normal block                 */
+    unsigned long nallocs;      /* arena_alloc() calls, for statistics    */
+    unsigned long nblocks;      /* malloc() calls behind them             */
+} *arena_p;
+
+void arena_init(struct arena *p_a, size_t block_size);
+void *arena_alloc(struct arena *p_a, size_t size);
+void *arena_calloc(struct arena *p_a, size_t size);
+void *arena_dup(struct arena *p_a, const void *src, size_t size);
+void arena_reset(struct arena *p_a);
+void arena_release(struct arena *p_a);
@@ -2,16 +2,23 @@
  * @biref To demonstrate how to use zutil.c and crc.c functions
  */
 
+#define _POSIX_C_SOURCE 200809L /* for getopt() */
+
 #include <stdio.h>    /* for printf(), perror()...   */
 #include <stdlib.h>   /* for malloc()                */
 #include <errno.h>    /* for errno                   */
-#include "crc.h"      /* for crc()                   */
+#include "crc.h"      /* for the running CRC, crc_update() */
 #include "zutil.h"    /* for mem_def() and mem_inf() */
 #include "lab_png.h"  /* simple PNG data structures  */
+#include "arena.h"    /* for the small, long lived allocations */
+#include "png_filter.h" /* for png_refilter(), png_unfilter() */
 #include <sys/types.h>/* for data types*/
 #include <sys/stat.h> /* stats of data i.e. last access , READ MAN*/
 #include <unistd.h>   /* for standard symbolic constants and types*/
 #include <string.h>
+#include <arpa/inet.h>/* for htonl()                  */
+#include <pthread.h>  /* for the -j decode workers    */
+#include <time.h>     /* for clock_gettime(), -v       */
 
 /******************************************************************************
  * DEFINED MACROS 
@@ -24,12 +31,62 @@
  *****************************************************************************/
 U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
 U8 gp_buf_inf[BUF_LEN2]; /* output buffer for mem_inf() */
+int g_jobs = 0;          /* -j N: decode, re-filter and deflate threads, 0 for one of each */
+int g_stream = 0;        /* -s: stream rows into 256K IDATs in bounded memory */
+int g_splice = 1;        /* splice the IDAT streams, -r, -f or a failed splice clears it */
+int g_refilter = 0;      /* -f: choose every row's filter anew before deflating */
+int g_raw = 0;           /* -x: write the pixels unfiltered to all.raw, nothing deflated */
+int g_verbose = 0;       /* -v: report the image data's size and time to stderr */
+struct z_join g_join;    /* the spliced IDAT stream while g_splice is set */
+struct data_IHDR g_first_iHDR; /* first input's IHDR, spliced ones must match it */
+U8 *g_rows = NULL;       /* when not splicing: every input's scanlines, in order */
+U64 g_rowsLen = 0;       /* bytes of g_rows in use */
+U64 g_rowsCap = 0;       /* allocated size of g_rows */
+int g_keepAncillary = 0; /* -a: copy the first input's ancillary chunks too */
+struct arena g_arena;    /* chunk headers, plans, kept chunks: all freed together at the end */
+struct chunk *g_kept = NULL; /* PLTE and (-a) ancillary chunks to write, in order */
+int g_nKept = 0;         /* entries in g_kept */
+int g_keptCap = 0;       /* room in g_kept */
+int g_nKeptBefore = 0;   /* how many of them go before the image data */
+
+/* -r -j N: one input, decoded by a worker into its own rows of g_rows
+   before main() walks the inputs in order to do the rest */
+typedef struct decodeJob {
+	char *name;
+	int isFirst;
+	struct png_map map;     /* stays mapped until init_iHDR() is done with it */
+	struct png_view pv;     /* the worker's full parse of it */
+	struct data_IHDR ihdr;  /* from the header pre-pass */
+	U64 offset;             /* where its rows go in g_rows */
+	U64 len;                /* and how many bytes they are */
+	int err;                /* DECODE_OK or what went wrong, reported in input order */
+} decodeJob;
+
+#define DECODE_OK      0
+#define DECODE_CORRUPT 1 /* bad chunk, CRC or chunk order */
+#define DECODE_INFLATE 2 /* bad zlib data or wrong amount of it */
+#define DECODE_FILTER  3 /* bad filter type in the first row */
+#define DECODE_CHUNKS  4 /* more critical chunks than a png_view holds */
+
+/* from the header pre-pass, before any input is read past its IHDR */
+struct data_IHDR *g_plan = NULL; /* every input's IHDR, host byte order */
+U32 g_planHeight = 0;    /* height of the output */
+U64 g_planRaw = 0;       /* exact size of the output's scanlines */
+U64 g_planFiles = 0;     /* input file sizes added up, bounds the spliced IDAT */
+
+struct decodeJob *g_decoded = NULL; /* one per input once decodeInputs() ran */
+int g_nDecoded = 0;      /* entries in g_decoded */
+int g_nextJob = 0;       /* next entry for a worker to take */
+pthread_mutex_t g_jobLock = PTHREAD_MUTEX_INITIALIZER; /* guards g_nextJob */
 
 /******************************************************************************
  * FUNCTION PROTOTYPES 
  *****************************************************************************/
 
 void init_data(U8 *buf, int len);
+void *arenaGet(struct arena *, size_t);
+double nowMs(void);
+int deflateRows(U8 *, U64 *);
 
 /******************************************************************************
  * FUNCTIONS 
@@ -46,120 +103,269 @@ void init_data(U8 *buf, int len)
     }
 }
 
-int isPng(char *);
-void init_iHDR(struct data_IHDR *, char *, U32 *, struct simple_PNG *, int);
-void init_iDAT(struct data_IHDR *, FILE *, U32 *, struct simple_PNG *, int);
-void init_iEND(struct data_IHDR *, FILE *, U32 *, struct simple_PNG *, int);
-U8* concatenation(const U8 *, const U32, const U8 *, const U32);
-void buildPng(struct simple_PNG *, FILE *);
+/**
+ * @brief zeroed memory from an arena, exits if there is none left
+ */
+void *arenaGet(struct arena *a, size_t size)
+{
+	void *p = arena_calloc(a, size);
+	if (p == NULL) {
+		perror("malloc");
+		exit(3);
+	}
+	return p;
+}
+
+int planInputs(char **, int);
+void init_iHDR(struct data_IHDR *, char *, U32 *, struct simple_PNG *, int, struct decodeJob *);
+void init_iDAT(struct data_IHDR *, const struct png_view *, U32, struct simple_PNG *, int, char *, const struct decodeJob *);
+void decodeInputs(char **, int);
+void *decodeWorker(void *);
+void init_iEND(const struct png_view *, struct simple_PNG *, int, char *);
+void keepChunk(const U8 *, const U8 *, U32, int, int, char *);
+int writeKept(struct png_out *, int, int);
+void checkCrc(U8 *, struct crc_ctx *, char *);
+int spliceIdat(struct data_IHDR *, U8 *, U32, struct simple_PNG *, int);
+int buildPng(struct simple_PNG *, struct png_out *);
+int streamPngs(char **, int);
+void streamRows(FILE *, char *, struct data_IHDR *, struct idat_writer *, int);
+int readChunkHead(FILE *, U32 *, U8 *);
 
 int main(int argc, char **argv)
 {
-	int success, isFirst;
+	int isFirst, opt;
 	isFirst = 1;
 	U32 totalHeight = 0;
-	for (int i = 1; i < argc; i++) {
-		success = isPng(argv[i]);
-		if (success == 0) {
-			printf("Please enter the correct path to a valid PNG file\n");
+	arena_init(&g_arena, 0);
+	while ((opt = getopt(argc, argv, "afj:rsvx")) != -1) {
+		switch (opt) {
+		case 'a':
+			g_keepAncillary = 1;
+			break;
+		case 'f':
+			g_refilter = 1;
+			g_splice = 0;
+			break;
+		case 's':
+			g_stream = 1;
+			break;
+		case 'r':
+			g_splice = 0;
+			break;
+		case 'x':
+			g_raw = 1;
+			g_splice = 0;
+			break;
+		case 'v':
+			g_verbose = 1;
+			break;
+		case 'j':
+			g_jobs = atoi(optarg);
+			if (g_jobs <= 0) {
+				fprintf(stderr, "%s: -j needs a thread count > 0\n", argv[0]);
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a] [-f | -r | -s | -x] [-j threads] [-v] <png file> ...\n", argv[0]);
+			fprintf(stderr, "  -a  keep the first input's ancillary chunks (gAMA, tEXt, ...)\n");
+			fprintf(stderr, "  -f  as -r, choosing every row's filter anew for a smaller file\n");
+			fprintf(stderr, "  -r  recompress the image data instead of splicing it\n");
+			fprintf(stderr, "  -j  threads for decoding (with -r), re-filtering and deflating the image data\n");
+			fprintf(stderr, "  -s  recompress as a stream, memory use independent of image size\n");
+			fprintf(stderr, "  -x  write the pixels to all.raw instead, unfiltered and uncompressed after a 32 byte header\n");
+			fprintf(stderr, "  -v  with -r or -f, report the deflated size and time; -f also deflates the rows\n");
+			fprintf(stderr, "      with their original filters to compare against\n");
 			return -1;
 		}
-
 	}
-	FILE *concatenated_png;
+	if (g_refilter && g_stream) {
+		fprintf(stderr, "%s: -f needs the whole image in memory, it can't be used with -s\n", argv[0]);
+		return -1;
+	}
+	if (g_raw && (g_stream || g_refilter)) {
+		fprintf(stderr, "%s: -x writes no image data to compress, it can't be used with -f or -s\n", argv[0]);
+		return -1;
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: %s [-a] [-f | -r | -s | -x] [-j threads] [-v] <png file> ...\n", argv[0]);
+		return -1;
+	}
+	//33 bytes of every input first: a bad or mismatched one is turned
+	//down before any image data is read, and every buffer can be sized
+	if (planInputs(argv + optind, argc - optind) != 0) {
+		printf("Please enter the correct path to a valid PNG file\n");
+		return -1;
+	}
+	if (g_stream) {
+		return streamPngs(argv + optind, argc - optind);
+	}
+	struct png_out concatenated_png;
 	struct data_IHDR test_iHDR;
 	struct simple_PNG test;
-	test.p_IHDR = malloc(sizeof(struct chunk));
-	memset(test.p_IHDR, 0, sizeof(struct chunk));
-	test.p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	memset(test.p_IHDR->p_data, 0, DATA_IHDR_SIZE);
+	test.p_IHDR = arenaGet(&g_arena, sizeof(struct chunk));
+	test.p_IHDR->p_data = arenaGet(&g_arena, DATA_IHDR_SIZE);
 	test.p_IHDR->length = DATA_IHDR_SIZE;
-	test.p_IDAT = malloc(sizeof(struct chunk));
-	memset(test.p_IDAT, 0, sizeof(struct chunk));
+	test.p_IDAT = arenaGet(&g_arena, sizeof(struct chunk));
 	test.p_IDAT->length = 0;
-	test.p_IDAT->p_data = malloc(1);
-	test.p_IDAT->p_data[0] = '\0';
-	test.p_IEND = malloc(sizeof(struct chunk));
-	memset(test.p_IEND, 0, sizeof(struct chunk));
-
-	concatenated_png = fopen("all.png", "wb");
-    
-	for (int i = 1; i < argc; i++) {
-		init_iHDR(&test_iHDR, argv[i], &totalHeight, &test, isFirst);
-		isFirst = 0;
-	}
-	U32 crc_idat;
-	crc_idat = crc(concatenation(&test.p_IDAT->type, CHUNK_TYPE_SIZE, test.p_IDAT->p_data, test.p_IDAT->length), CHUNK_TYPE_SIZE + test.p_IDAT->length);
-	test.p_IDAT->crc = htonl(crc_idat);
-
-	
-	buildPng(&test, concatenated_png);
+	test.p_IDAT->p_data = NULL; //the join or the deflated rows, both malloc'd
+	test.p_IEND = arenaGet(&g_arena, sizeof(struct chunk));
 
+	const char *outName = g_raw ? "all.raw" : "all.png";
+	if (png_out_open(&concatenated_png, outName) != 0) {
+		perror(outName);
+		exit(3);
+	}
 
-	fclose(concatenated_png);
-	free(test.p_IHDR->p_data);
+	//everything the image data needs is allocated here, once: the rows of
+	//every input and the worst case of deflating them
+	U8 *deflated_data = NULL;
+	if (g_splice == 0) {
+		g_rows = malloc(g_planRaw > 0 ? g_planRaw : 1);
+		if (g_raw == 0) {
+			deflated_data = malloc(mem_def_bound(g_planRaw));
+		}
+		if (g_rows == NULL || (g_raw == 0 && deflated_data == NULL)) {
+			perror("malloc");
+			exit(3);
+		}
+		g_rowsCap = g_planRaw;
+	}
+	if (g_splice == 0 && g_jobs > 1 && argc - optind > 1) {
+		//inflate every input at once, each into its own part of g_rows
+		decodeInputs(argv + optind, argc - optind);
+	}
+	for (int i = optind; i < argc; i++) {
+		init_iHDR(&test_iHDR, argv[i], &totalHeight, &test, isFirst, g_decoded != NULL ? &g_decoded[i - optind] : NULL);
+		isFirst = 0;
+	}
+	if (g_raw) {
+		//the rows are only unfiltered and packed, png_out_close() writes
+		//them straight from g_rows after a small header
+		struct data_IHDR out_iHDR = g_plan[0];
+		const struct chunk *plte = NULL;
+		out_iHDR.height = g_planHeight;
+		if (png_unfilter(g_rows, g_planHeight, &out_iHDR) != 0) {
+			fprintf(stderr, "all.raw: bad filter type in the image data\n");
+			exit(3);
+		}
+		//indexed-colour pixels are no use without their palette, it goes last
+		for (int i = 0; i < g_nKept && out_iHDR.color_type == 3; i++) {
+			if (memcmp(g_kept[i].type, "PLTE", CHUNK_TYPE_SIZE) == 0) {
+				plte = &g_kept[i];
+			}
+		}
+		U32 plteLen = plte != NULL ? plte->length : 0;
+		if (png_out_raw_header(&concatenated_png, &out_iHDR, plteLen) != 0 || png_out_data(&concatenated_png, g_rows, png_pack_rows(g_rows, g_planHeight, &out_iHDR)) != 0 || (plteLen > 0 && png_out_data(&concatenated_png, plte->p_data, plteLen) != 0) || png_out_close(&concatenated_png) != 0) {
+			perror("all.raw");
+			exit(3);
+		}
+		free(g_rows);
+		arena_release(&g_arena);
+		return 0;
+	}
+	if (g_splice == 0) {
+		//one deflate over the rows of every input
+		U64 deflateLength = 0;
+		int ret;
+		if (deflated_data == NULL) { //a splice fell through part-way
+			deflated_data = malloc(mem_def_bound(g_rowsLen));
+		}
+		if (deflated_data == NULL) {
+			perror("malloc");
+			exit(3);
+		}
+		//-v -f: the rows with the filters they came with, deflated
+		//once just to have something to compare against
+		U64 origLength = 0;
+		double origMs = 0, refilterMs = 0, deflateMs;
+		if (g_verbose && g_refilter) {
+			origMs = nowMs();
+			ret = deflateRows(deflated_data, &origLength);
+			origMs = nowMs() - origMs;
+			if (ret != 0) { /* failure */
+				fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
+				exit(3);
+			}
+		}
+		//the inputs' own filters were chosen for them alone, pick each
+		//row's anew now that all of it is here
+		refilterMs = nowMs();
+		if (g_refilter && png_refilter(g_rows, g_planHeight, &g_plan[0], g_jobs > 0 ? g_jobs : 1) != 0) {
+			fprintf(stderr, "all.png: bad filter type in the image data\n");
+			exit(3);
+		}
+		deflateMs = nowMs();
+		refilterMs = deflateMs - refilterMs;
+		ret = deflateRows(deflated_data, &deflateLength);
+		deflateMs = nowMs() - deflateMs;
+		if (ret != 0) { /* failure */
+			fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
+			exit(3);
+		}
+		if (g_verbose && g_refilter) {
+			fprintf(stderr, "all.png: %lu bytes of rows; original filters: %lu bytes deflated in %.1f ms; "
+			        "re-filtered: %lu bytes (%+.1f%%) in %.1f ms (%.1f re-filter + %.1f deflate)\n",
+			        g_rowsLen, origLength, origMs, deflateLength,
+			        origLength > 0 ? 100.0 * ((double) deflateLength - origLength) / origLength : 0.0,
+			        refilterMs + deflateMs, refilterMs, deflateMs);
+		} else if (g_verbose) {
+			fprintf(stderr, "all.png: %lu bytes of rows deflated to %lu bytes in %.1f ms\n",
+			        g_rowsLen, deflateLength, deflateMs);
+		}
+		free(g_rows);
+		free(test.p_IDAT->p_data);
+		test.p_IDAT->p_data = deflated_data;
+		test.p_IDAT->length = deflateLength;
+	}
+	if (buildPng(&test, &concatenated_png) != 0) {
+		perror("all.png");
+		exit(3);
+	}
+	//everything goes out here, in one write
+	if (png_out_close(&concatenated_png) != 0) {
+		perror("all.png");
+		exit(3);
+	}
 	free(test.p_IDAT->p_data);
-	free(test.p_IEND->p_data);
-	free(test.p_IHDR);
-	free(test.p_IDAT);
-	free(test.p_IEND);
+	arena_release(&g_arena);
 	return 0;
 }
 
-void init_iHDR(struct data_IHDR *test_iHDR, char *png_name, U32 *totalHeight, struct simple_PNG *test, int isFirst) {
-	FILE *pngFiles;
-	U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
-	U32 crc_val = 0;      /* CRC value                                     */
-	int ret = 0;          /* return value for various routines             */
-	U64 len_def = 0;      /* compressed data length                        */
-	U64 len_inf = 0;      /* uncompressed data length                      */
-	U8 crc_buffer[17];
-
-	/* Step 1: Initialize some data in a buffer */
-	/* Step 1.1: Allocate a dynamic buffer */
-	p_buffer = malloc(BUF_LEN);
-	if (p_buffer == NULL) {
-		perror("malloc");
-		return errno;
-	}
-	pngFiles = fopen(png_name, "rb");
-	p_buffer = malloc(PNG_SIG_SIZE +1);
-	memset(p_buffer, 0, PNG_SIG_SIZE + 1);
-	fread(p_buffer, 1, PNG_SIG_SIZE, pngFiles);
-	p_buffer[PNG_SIG_SIZE] = '\0';
-	free(p_buffer);
-
-	p_buffer = malloc(CHUNK_LEN_SIZE); //get length of data
-	memset(p_buffer, 0, CHUNK_LEN_SIZE);
-
-	fread(p_buffer, 1, CHUNK_LEN_SIZE, pngFiles);
+void init_iHDR(struct data_IHDR *test_iHDR, char *png_name, U32 *totalHeight, struct simple_PNG *test, int isFirst, struct decodeJob *job) {
+	struct png_map map;   /* the whole input file, mapped                  */
+	struct png_view pv;   /* where its chunks are, nothing is copied       */
+	int parsed;
 
+	if (job != NULL) {
+		//a worker already mapped and parsed it, and inflated its rows
+		map = job->map;
+		pv = job->pv;
+		parsed = (job->err == DECODE_CORRUPT) ? -2 : (job->err == DECODE_CHUNKS) ? -3 : 0;
+	}
+	else {
+		if (png_map_file(&map, png_name) != 0) {
+			perror(png_name);
+			exit(3);
+		}
+		//only the first input's ancillary chunks can make it to the output
+		parsed = png_view_parse(&pv, map.buf, map.size, (isFirst == 0 || g_keepAncillary == 0) ? PNG_VIEW_SKIP_ANCILLARY : 0);
+	}
+	if (parsed == -3) {
+		fprintf(stderr, "%s: more chunks than the %d catpng can keep track of\n", png_name, PNG_MAX_VIEWS);
+		exit(3);
+	}
+	if (parsed != 0) {
+		fprintf(stderr, "%s: corrupt, a chunk is cut short, has a bad CRC or is out of place\n", png_name);
+		exit(3);
+	}
+	if (pv.dropped > 0) {
+		fprintf(stderr, "%s: warning: too many chunks, the last %d ancillary ones are left out\n", png_name, pv.dropped);
+	}
 
-	U32 length_ihdr;
-	
-	memcpy(&length_ihdr, p_buffer, CHUNK_LEN_SIZE);
-	length_ihdr = htonl(length_ihdr);
-	test->p_IHDR->length = length_ihdr;
-	//test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	//test->p_IHDR->length = DATA_IHDR_SIZE;
-	free(p_buffer);
-	p_buffer = malloc(sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memset(p_buffer, 0, sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	fread(p_buffer, 1, sizeof(U8) * CHUNK_TYPE_SIZE, pngFiles);
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		test->p_IHDR->type[i] = *(p_buffer + i);
-		crc_buffer[i] = test->p_IHDR->type[i];
-	}
-	free(p_buffer);
-	p_buffer = malloc(test->p_IHDR->length);
-	memset(p_buffer, 0, test->p_IHDR->length);
-	fread(p_buffer, 1, length_ihdr, pngFiles);
-	for (int i = 0; i < length_ihdr; i++) {
-		crc_buffer[i + 4] = *(p_buffer + i);
-		*(test->p_IHDR->p_data + i) = *(p_buffer + i);
-		//printf("%02X", *(test->p_IHDR->p_data + i));
-	}
-	free(p_buffer);
+	memcpy(test->p_IHDR->type, pv.chunks[0].type, CHUNK_TYPE_SIZE);
+	memcpy(test->p_IHDR->p_data, pv.buf + pv.chunks[0].offset, DATA_IHDR_SIZE);
+	test->p_IHDR->length = DATA_IHDR_SIZE;
 	
 	int incrementation = 0;
 
@@ -176,280 +382,692 @@ void init_iHDR(struct data_IHDR *test_iHDR, char *png_name, U32 *totalHeight, st
 	test_iHDR->height = *(totalHeight); //updating max height
 	test_iHDR->height = htonl(test_iHDR->height);
 	memcpy(test->p_IHDR->p_data + incrementation, &test_iHDR->height, sizeof(test_iHDR->height));
-	//printf("------------------ Height from test: %02X%02X%02X%02X\n", *(test->p_IHDR->p_data + incrementation), *(test->p_IHDR->p_data + incrementation + 1), *(test->p_IHDR->p_data + incrementation + 2), *(test->p_IHDR->p_data + incrementation + 3));
 	test_iHDR->height = htonl(test_iHDR->height);
-	//printf("NEW SIZE: %08X\n\n\n", test_iHDR->height);
 	incrementation += sizeof(test_iHDR->height);
 
 	//doing	bit depth
 	memcpy(&test_iHDR->bit_depth, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->bit_depth));
 	incrementation += sizeof(test_iHDR->bit_depth);
-	//test_iHDR->bit_depth = htonl(test_iHDR->height);
 
 	//doing color type
 	memcpy(&test_iHDR->color_type, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->color_type));
 	incrementation += sizeof(test_iHDR->color_type);
-	//test_iHDR->color_type = htonl(test_iHDR->color_type);
 
 	//doing compression
 	memcpy(&test_iHDR->compression, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->compression));
 	incrementation += sizeof(test_iHDR->compression);
-	//test_iHDR->compression = htonl(test_iHDR->compression);
 
 	//doing filter
 	memcpy(&test_iHDR->filter, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->filter));
 	incrementation += sizeof(test_iHDR->filter);
-	//test_iHDR->filter = htonl(test_iHDR->filter);
 
 	//doing interlace
 	memcpy(&test_iHDR->interlace, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->interlace));
 	incrementation += sizeof(test_iHDR->interlace);
-	
-	//test_iHDR->interlace = htonl(test_iHDR->interlace);
-	p_buffer = malloc(CHUNK_CRC_SIZE);
-	memset(p_buffer, 0, CHUNK_CRC_SIZE);
-	fread(p_buffer, 1, CHUNK_CRC_SIZE, pngFiles);
-	free(p_buffer);
-	for (int i = 0; i < 13; i++) {
-		crc_buffer[i+4] =  *(test->p_IHDR->p_data + i);
-	}
-	unsigned int crc_return;
-	crc_return = crc(&crc_buffer, DATA_IHDR_SIZE + CHUNK_TYPE_SIZE);
-	test->p_IHDR->crc = htonl(crc_return);
-	init_iDAT(test_iHDR, pngFiles, &curr_chunk_height, test, isFirst);
+
+	//IDAT data is inflated (or spliced) straight out of the mapping
+	init_iDAT(test_iHDR, &pv, curr_chunk_height, test, isFirst, png_name, job);
+	png_unmap(&map);
 }
 
-void init_iDAT(struct data_IHDR *test_iHDR, FILE *pngFiles,  U32 *totalHeight, struct simple_PNG *test, int isFirst) {
-	
-	U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
-	U32 crc_val = 0;      /* CRC value                                     */
+//inputHeight is this input's own height, test_iHDR->height is the running total
+void init_iDAT(struct data_IHDR *test_iHDR, const struct png_view *pv, U32 inputHeight, struct simple_PNG *test, int isFirst, char *png_name, const struct decodeJob *job) {
 	int ret = 0;          /* return value for various routines             */
-	U64 len_def = 0;      /* compressed data length                        */
-	U64 len_inf = 0;      /* uncompressed data length                      */
+	const struct chunk_view *idat = &pv->chunks[pv->idat];
 
-	p_buffer = malloc(CHUNK_LEN_SIZE); //get length of data
-	memset(p_buffer, 0, CHUNK_LEN_SIZE);
+	//chunks between IHDR and the image data, e.g. PLTE
+	for (int i = 1; i < pv->idat; i++) {
+		keepChunk(pv->chunks[i].type, pv->buf + pv->chunks[i].offset, pv->chunks[i].length, 0, isFirst, png_name);
+	}
+	memcpy(test->p_IDAT->type, idat->type, CHUNK_TYPE_SIZE);
 
-	fread(p_buffer, 1, CHUNK_LEN_SIZE, pngFiles);
-	
+	//exact size of this input's scanlines, all IDAT chunks together
+	U64 expected = png_stride(test_iHDR) * inputHeight;
+	if (expected == 0) {
+		fprintf(stderr, "%s: bad color type or bit depth in IHDR\n", png_name);
+		exit(3);
+	}
 
-	U32 chuck_length;
-	memcpy(&chuck_length, p_buffer, CHUNK_LEN_SIZE);
-	chuck_length = htonl(chuck_length);
-	
-	test->p_IDAT->length += chuck_length;
-	//simple_PNG_p test = malloc(sizeof(struct simple_PNG));
-
-	//test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	//test->p_IHDR->length = DATA_IHDR_SIZE;
-	free(p_buffer);
-	p_buffer = malloc(sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memset(p_buffer, 0, sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	fread(p_buffer, 1, sizeof(U8) * CHUNK_TYPE_SIZE, pngFiles);
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		test->p_IDAT->type[i] = *(p_buffer + i);
-	}
-
-	free(p_buffer);
-	p_buffer = malloc(chuck_length);
-	memset(p_buffer, 0, chuck_length);
-	fread(p_buffer, 1, chuck_length, pngFiles);
-	//printf("Size of p_buffer: %02X\n", sizeof(p_buffer));
-	//p_buffer[chuck_length] = '\0';
-	//printf("Chuck length of: %02X\n\n\n", chuck_length);
-	//printf("p_buffer data: \n")
-	U8 *inflated = malloc((test_iHDR->width * 4 + 1)*test_iHDR->height);
-	memset(inflated, 0, (test_iHDR->width * 4 + 1)*test_iHDR->height);
-	U64 lengthInf = 0;
-	U64 lengthCur = 0;
-	U64 deflateLength = 0;
-	U8 *currData = malloc((test_iHDR->width*4 + 1) * *(totalHeight));
-	
-	memset(currData, 0, (test_iHDR->width * 4 + 1) * *(totalHeight));
-	
-	if (isFirst == 0) {
-		ret = mem_inf(inflated, &lengthInf, test->p_IDAT->p_data, test->p_IDAT->length - chuck_length);
-		if(ret == 0) { /* success */
-			//printf("original len = %d, len_def = %lu, len_inf = %lu\n", \
-				chuck_length, len_def, lengthCur);
+	U64 rowsStart = g_rowsLen;
+	if (g_splice) {
+		//splicing needs the zlib stream in one piece, which it already is
+		//unless the encoder split it over several IDAT chunks
+		U8 *zdata = (U8 *) pv->buf + idat->offset;
+		U8 *gathered = NULL;
+		U64 zlen = idat->length;
+		if (idat->count > 1) {
+			gathered = malloc(zlen);
+			if (gathered == NULL) {
+				perror("malloc");
+				exit(3);
+			}
+			png_view_copy_idat(pv, gathered);
+			zdata = gathered;
+		}
+		if (spliceIdat(test_iHDR, zdata, zlen, test, isFirst) == 0) {
+			free(gathered);
+			init_iEND(pv, test, isFirst, png_name);
+			return;
+		}
+		//can't splice this one, unpack what was spliced so far (once) and
+		//decode the rest of the inputs onto the end of it
+		g_splice = 0;
+		if (isFirst == 0) {
+			ret = mem_inf_append(&g_rows, &g_rowsLen, &g_rowsCap, test->p_IDAT->p_data, test->p_IDAT->length, 0);
+			if (ret != 0) { /* failure */
+				fprintf(stderr, "%s: mem_inf failed. ret = %d.\n", png_name, ret);
+				exit(3);
+			}
 		}
-		else { /* failure */
-			fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
+		free(test->p_IDAT->p_data);
+		test->p_IDAT->p_data = NULL;
+		rowsStart = g_rowsLen;
+		ret = mem_inf_append(&g_rows, &g_rowsLen, &g_rowsCap, zdata, zlen, expected);
+		free(gathered);
+		if (ret != 0 || g_rowsLen - rowsStart != expected) { /* failure */
+			fprintf(stderr, "%s: mem_inf failed. ret = %d.\n", png_name, ret);
+			exit(3);
 		}
 	}
-	ret = mem_inf(currData, &lengthCur, p_buffer, chuck_length);
-	free(p_buffer);
-//ret = mem_inf(gp_buf_inf, &len_inf, gp_buf_def, len_def);
-	if (ret == 0) { /* success */
-		//printf("original len = %d, len_def = %lu, len_inf = %lu\n", \
-			chuck_length, len_def, lengthCur);
+	else if (job != NULL) {
+		//a worker inflated it into its place in g_rows and detached its
+		//first row already, only the errors are left to report, in order
+		if (job->err == DECODE_INFLATE) {
+			fprintf(stderr, "%s: bad image data\n", png_name);
+			exit(3);
+		}
+		if (job->err == DECODE_FILTER) {
+			fprintf(stderr, "%s: bad color type or filter in image data\n", png_name);
+			exit(3);
+		}
+		g_rowsLen += expected;
+		init_iEND(pv, test, isFirst, png_name);
+		return;
 	}
-	else { /* failure */
-		fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
+	else {
+		//each input is inflated exactly once, straight onto the end of
+		//g_rows; main() deflates all of it in one go after the last input
+		if (g_rowsCap - g_rowsLen < expected) {
+			U64 newCap = g_rowsLen + expected;
+			if (newCap < g_rowsCap * 2) {
+				newCap = g_rowsCap * 2;
+			}
+			U8 *p = realloc(g_rows, newCap);
+			if (p == NULL) {
+				perror("realloc");
+				exit(3);
+			}
+			g_rows = p;
+			g_rowsCap = newCap;
+		}
+		if (png_view_inflate_idat(pv, g_rows + g_rowsLen, expected) != 0) {
+			fprintf(stderr, "%s: bad image data\n", png_name);
+			exit(3);
+		}
+		g_rowsLen += expected;
+	}
+	//the row above this image's first row is no longer all zeros
+	if (isFirst == 0 && png_detach_first_row(g_rows + rowsStart, test_iHDR) != 0) {
+		fprintf(stderr, "%s: bad color type or filter in image data\n", png_name);
+		exit(3);
+	}
+	init_iEND(pv, test, isFirst, png_name);
+}
+
+void init_iEND(const struct png_view *pv, struct simple_PNG *test, int isFirst, char *png_name)
+{
+	//chunks after the image data; png_view_parse() made sure IEND is last
+	for (int i = pv->idat + 1; i < pv->nchunks - 1; i++) {
+		keepChunk(pv->chunks[i].type, pv->buf + pv->chunks[i].offset, pv->chunks[i].length, 1, isFirst, png_name);
 	}
-	U8 *new_data;
 	if (isFirst == 1) {
-		new_data = malloc(lengthCur);
-		new_data = currData;
+		memcpy(test->p_IEND->type, pv->chunks[pv->nchunks - 1].type, CHUNK_TYPE_SIZE);
+		test->p_IEND->length = 0;
+		test->p_IEND->p_data = NULL;
 	}
-	else
-	{
-		new_data = malloc(lengthInf + lengthCur);
-		new_data = concatenation(inflated, lengthInf, currData, lengthCur);
+}
+
+/**
+ * @brief -r -j N: inflate all the inputs at the same time, g_jobs workers
+ *        each taking the next input in line. The header pre-pass gave
+ *        every input's exact row range in g_rows (allocated by main()),
+ *        so the workers write straight into place.
+ *        init_iHDR() then walks the inputs in order for everything else
+ *        (kept chunks, error messages) as it does without -j.
+ */
+void decodeInputs(char **names, int count)
+{
+	U64 total = 0;
+	int nthreads = g_jobs < count ? g_jobs : count;
+	pthread_t *tids;
+
+	g_decoded = arenaGet(&g_arena, count * sizeof(struct decodeJob));
+	tids = arenaGet(&g_arena, nthreads * sizeof(pthread_t));
+	for (int i = 0; i < count; i++) {
+		struct decodeJob *job = &g_decoded[i];
+		job->name = names[i];
+		job->isFirst = (i == 0);
+		job->err = DECODE_OK;
+		if (png_map_file(&job->map, names[i]) != 0) {
+			perror(names[i]);
+			exit(3);
+		}
+		job->ihdr = g_plan[i];
+		job->len = png_stride(&job->ihdr) * job->ihdr.height;
+		job->offset = total;
+		total += job->len;
 	}
-	
-	free(test->p_IDAT->p_data);
-	U8 *deflated_data = malloc((test_iHDR->width * 4 + 1)*test_iHDR->height);
-	ret = mem_def(deflated_data, &deflateLength, new_data, lengthCur + lengthInf, Z_DEFAULT_COMPRESSION);
-	//ret = mem_def(deflated_data, deflateLength, new_data, lengthCur + lengthInf, -1);
-	//    ret = mem_def(gp_buf_def, &len_def, p_buffer, BUF_LEN, Z_DEFAULT_COMPRESSION);
-	if (ret == 0) { /* success */
-	   //printf("original len = %d, len_def = %lu\n", lengthCur + lengthInf, deflateLength);
-    } else { /* failure */
-       fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
-       return ret;
-    }
-	test->p_IDAT->p_data = deflated_data;
-	test->p_IDAT->length = deflateLength;
+	g_nDecoded = count;
+	g_nextJob = 0;
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, decodeWorker, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(3);
+		}
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
+
+/**
+ * @brief decodeInputs() worker: parse, inflate and detach the first row
+ *        of inputs until there are none left. Errors are only recorded,
+ *        main() reports the first one in input order.
+ */
+void *decodeWorker(void *arg)
+{
+	(void) arg;
+	for (;;) {
+		pthread_mutex_lock(&g_jobLock);
+		int i = g_nextJob++;
+		pthread_mutex_unlock(&g_jobLock);
+		if (i >= g_nDecoded) {
+			return NULL;
+		}
+		struct decodeJob *job = &g_decoded[i];
+		U8 *rows = g_rows + job->offset;
+		int parsed = png_view_parse(&job->pv, job->map.buf, job->map.size, (job->isFirst == 0 || g_keepAncillary == 0) ? PNG_VIEW_SKIP_ANCILLARY : 0);
+		if (parsed != 0) {
+			job->err = (parsed == -3) ? DECODE_CHUNKS : DECODE_CORRUPT;
+		}
+		else if (png_view_inflate_idat(&job->pv, rows, job->len) != 0) {
+			job->err = DECODE_INFLATE;
+		}
+		else if (job->isFirst == 0 && png_detach_first_row(rows, &job->ihdr) != 0) {
+			job->err = DECODE_FILTER;
+		}
+	}
+}
+
+/**
+ * @brief deal with a chunk other than IHDR, IDAT or IEND. PLTE is always
+ *        kept from the first input and must be the same in the others;
+ *        with -a the first input's ancillary chunks are kept as well.
+ *        Kept chunks are copied, in file order, to g_kept for the writer.
+ * @param afterIdat 1 if the chunk came after the image data
+ */
+void keepChunk(const U8 *type, const U8 *data, U32 length, int afterIdat, int isFirst, char *png_name)
+{
+	if (memcmp(type, "PLTE", CHUNK_TYPE_SIZE) == 0) {
+		if (isFirst == 0) {
+			for (int i = 0; i < g_nKept; i++) {
+				if (memcmp(g_kept[i].type, "PLTE", CHUNK_TYPE_SIZE) == 0 && g_kept[i].length == length && memcmp(g_kept[i].p_data, data, length) == 0) {
+					return;
+				}
+			}
+			fprintf(stderr, "%s: palette differs from the first input\n", png_name);
+			exit(3);
+		}
+	}
+	else if (!CHUNK_IS_ANCILLARY(type)) {
+		fprintf(stderr, "%s: unknown critical chunk %.4s\n", png_name, (const char *) type);
+		exit(3);
+	}
+	else if (isFirst == 0 || g_keepAncillary == 0) {
+		return;
+	}
+
+	if (g_nKept == g_keptCap) {
+		//the old array stays in the arena, it is small and goes with the rest
+		int newCap = g_keptCap > 0 ? g_keptCap * 2 : 8;
+		struct chunk *p = arenaGet(&g_arena, newCap * sizeof(struct chunk));
+		if (g_nKept > 0) {
+			memcpy(p, g_kept, g_nKept * sizeof(struct chunk));
+		}
+		g_kept = p;
+		g_keptCap = newCap;
+	}
+	memcpy(g_kept[g_nKept].type, type, CHUNK_TYPE_SIZE);
+	g_kept[g_nKept].length = length;
+	g_kept[g_nKept].p_data = arenaGet(&g_arena, length);
+	memcpy(g_kept[g_nKept].p_data, data, length);
+	g_nKept++;
+	if (afterIdat == 0) {
+		g_nKeptBefore++;
+	}
+}
 
+/**
+ * @brief write the kept chunks [from, to) of g_kept
+ * @return 0 on success, -1 as soon as one can't be queued
+ */
+int writeKept(struct png_out *out, int from, int to)
+{
+	for (int i = from; i < to; i++) {
+		if (png_out_chunk(out, g_kept[i].type, g_kept[i].p_data, g_kept[i].length) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief append one input's IDAT stream to the output without recompressing
+ *        it. An input whose first row is filtered against the row above
+ *        (Up, Avg, Paeth) has that row rewritten to stand on its own; only
+ *        the deflate blocks around it are encoded again.
+ * @return 0 on success, -1 if this input can't be spliced (interlaced,
+ *         a different pixel format from the first input, bad zlib data)
+ */
+int spliceIdat(struct data_IHDR *test_iHDR, U8 *idat, U32 idat_len, struct simple_PNG *test, int isFirst)
+{
+	U64 stride = png_stride(test_iHDR);
+	U64 peekLen = stride;
+	U64 joinLen = 0;
+	U8 *first;
+	int ret;
+
+	if (test_iHDR->interlace != 0) {
+		return -1;
+	}
 	if (isFirst == 1) {
-		p_buffer = malloc(CHUNK_CRC_SIZE);
-		memset(p_buffer, 0, CHUNK_CRC_SIZE);
-		fread(p_buffer, 1, CHUNK_CRC_SIZE, pngFiles);
-		free(p_buffer);
-		init_iEND(test_iHDR, pngFiles, totalHeight, test, isFirst);
+		g_first_iHDR = *test_iHDR;
+		z_join_init(&g_join);
+		//each spliced stream is shorter than the file it came from, so
+		//only a re-encoded first row can make the join grow past this
+		g_join.buf = malloc(g_planFiles + 16);
+		g_join.cap = (g_join.buf != NULL) ? g_planFiles + 16 : 0;
+	}
+	else if (test_iHDR->width != g_first_iHDR.width || test_iHDR->bit_depth != g_first_iHDR.bit_depth || test_iHDR->color_type != g_first_iHDR.color_type) {
+		return -1;
+	}
+
+	//the first row is all that's needed to tell, and to fix it up
+	first = malloc(stride);
+	if (first == NULL || mem_inf_head(first, &peekLen, idat, idat_len) != 0 || peekLen != stride) {
+		free(first);
+		return -1;
+	}
+	if (isFirst == 0 && first[0] >= PNG_FILTER_UP) {
+		ret = png_detach_first_row(first, test_iHDR);
+		if (ret == 0) {
+			ret = z_join_add_head(&g_join, idat, idat_len, first, stride, Z_DEFAULT_COMPRESSION);
+		}
 	}
 	else {
-		fclose(pngFiles);
+		ret = z_join_add(&g_join, idat, idat_len);
+	}
+	free(first);
+	if (ret != 0 || z_join_end(&g_join, &joinLen) != 0) {
+		return -1;
 	}
+
+	//p_IDAT shares the join's buffer, main() frees it at the end
+	if (isFirst == 1) {
+		free(test->p_IDAT->p_data);
+	}
+	test->p_IDAT->p_data = g_join.buf;
+	test->p_IDAT->length = joinLen;
+	return 0;
 }
 
-void init_iEND(struct data_IHDR *test_iHDR, FILE *pngFiles, U32 *totalHeight, struct simple_PNG *test, int isFirst)
+void checkCrc(U8 *stored_crc, struct crc_ctx *computed, char *png_name)
 {
-	U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
-	U32 crc_val = 0;      /* CRC value                                     */
-	int ret = 0;          /* return value for various routines             */
-	U64 len_def = 0;      /* compressed data length                        */
-	U64 len_inf = 0;      /* uncompressed data length                      */
-
-	p_buffer = malloc(CHUNK_LEN_SIZE); //get length of data
-	memset(p_buffer, 0, CHUNK_LEN_SIZE);
-
-	fread(p_buffer, 1, CHUNK_LEN_SIZE, pngFiles);
-
-
-	U32 chuck_length;
-	memcpy(&chuck_length, p_buffer, CHUNK_LEN_SIZE);
-	chuck_length = htonl(chuck_length);
-	test->p_IEND->length = chuck_length;
-	//simple_PNG_p test = malloc(sizeof(struct simple_PNG));
-
-	//test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	//test->p_IHDR->length = DATA_IHDR_SIZE;
-	free(p_buffer);
-	p_buffer = malloc(sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memset(p_buffer, 0, sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	fread(p_buffer, 1, sizeof(U8) * CHUNK_TYPE_SIZE, pngFiles);
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		test->p_IEND->type[i] = *(p_buffer + i);
-	}
-	free(p_buffer);
-	p_buffer = malloc(chuck_length + 1);
-	memset(p_buffer, 0, chuck_length);
-	fread(p_buffer, 1, chuck_length, pngFiles);
-	p_buffer[chuck_length] = '\0';
-	test->p_IEND->p_data = p_buffer;
-	char *iend_crc = malloc(CHUNK_CRC_SIZE);
-	fread(p_buffer, 1, CHUNK_CRC_SIZE, pngFiles);
-	memcpy(&chuck_length, p_buffer, CHUNK_CRC_SIZE);
-	chuck_length = htonl(chuck_length);
-	test->p_IEND->crc = chuck_length;
-	fclose(pngFiles);
+	U32 expected;
+	memcpy(&expected, stored_crc, CHUNK_CRC_SIZE);
+	expected = htonl(expected);
+	if (expected != (U32) crc_final(computed)) {
+		fprintf(stderr, "%s: chunk CRC mismatch, file is corrupt\n", png_name);
+		exit(3);
+	}
 }
 
-U8* concatenation(const U8 *s1, const U32 size_s1, const U8 *s2, const U32 size_s2) {
-	//printf("First string is: %s | Second string is: %s\n", s1, s2);
-	//printf("Size of the first string %04X | Size of the second string: %04X\n", strlen(s1), strlen(s2));
+//returns 0 on success, -1 at the first chunk that can't be queued
+int buildPng(struct simple_PNG *test, struct png_out *concatenated_png)
+{
+	int ret;
+	//nothing is written or copied here: the chunks are queued where they
+	//are, with their headers and CRCs, and png_out_close() writes them
+	if (png_out_sig(concatenated_png) != 0 || png_out_chunk(concatenated_png, test->p_IHDR->type, test->p_IHDR->p_data, test->p_IHDR->length) != 0 || writeKept(concatenated_png, 0, g_nKeptBefore) != 0) {
+		return -1;
+	}
+
+	concatenated_png->nthreads = 0; //large IDATs get their CRC computed on all cores
+	ret = png_out_chunk(concatenated_png, test->p_IDAT->type, test->p_IDAT->p_data, test->p_IDAT->length);
+	concatenated_png->nthreads = 1;
+	if (ret != 0) {
+		return -1;
+	}
 
-	U8 *con = malloc(size_s1 + size_s2); /*length of s1 + length of s2 + \0 + "/" since it's added between the concatenations*/
-	memset(con, 0, size_s1 + size_s2);
-	memcpy(con, s1, size_s1);
-	memcpy(con + size_s1, s2, size_s2);
-	return con;
+	if (writeKept(concatenated_png, g_nKeptBefore, g_nKept) != 0 || png_out_chunk(concatenated_png, test->p_IEND->type, test->p_IEND->p_data, test->p_IEND->length) != 0) {
+		return -1;
+	}
+	return 0;
 }
 
-void buildPng(struct simple_PNG *test, FILE *concatenated_png)
+/**
+ * @brief read a chunk's length and type fields
+ * @return 0 on success, -1 at end of file or on a read error
+ */
+int readChunkHead(FILE *fp, U32 *length, U8 *type)
 {
-	//printf("IHDR: Length: %08X\n", test->p_IHDR->length);
-	//printf("IHDR: type: ");
-	//for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-	//	printf("%02X", test->p_IHDR->type[i]);
-	//}
-	//printf("\nIHDR: p_data: ");
-	unsigned char png_definition[] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, '\0' };
-	fwrite(&png_definition, PNG_SIG_SIZE, 1, concatenated_png);
-#if 0
-	for (int i = 0; i < test->p_IDAT->length; i++) {
-		printf("%02X\n", *(test->p_IDAT->p_data + i));
-	}
-#endif
-	/*for (U8 i = 0; i < test->p_IHDR->length; i++) {
-		printf("%02X", *(test->p_IHDR->p_data + i));
-	}*/
-	//printf("\nIHDR: CRC: %08X\n", test->p_IHDR->crc);
-	//printf("length ihdr: %08X\n", test->p_IHDR->length);
-	
-	test->p_IHDR->length = htonl(test->p_IHDR->length);
-	//fwrite(test->p_IHDR, CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, 1, concatenated_png);
-	fwrite(&test->p_IHDR->length, CHUNK_LEN_SIZE, 1, concatenated_png);
-	test->p_IHDR->length = htonl(test->p_IHDR->length);
-	fwrite(&test->p_IHDR->type, CHUNK_TYPE_SIZE, 1, concatenated_png);
-	fwrite(test->p_IHDR->p_data, test->p_IHDR->length, 1, concatenated_png);
-	fwrite(&test->p_IHDR->crc, 1, CHUNK_CRC_SIZE, concatenated_png);
-	//printf("string iHDR p_data: %s\n", *test->p_IHDR->p_data);
-	test->p_IDAT->length = htonl(test->p_IDAT->length);
-	fwrite(&test->p_IDAT->length, 1 , CHUNK_LEN_SIZE, concatenated_png);
-	test->p_IDAT->length = htonl(test->p_IDAT->length);
-	fwrite(&test->p_IDAT->type, 1,  CHUNK_TYPE_SIZE, concatenated_png);
-	fwrite(test->p_IDAT->p_data, 1, test->p_IDAT->length, concatenated_png);
-    fwrite(&test->p_IDAT->crc, 1, CHUNK_CRC_SIZE, concatenated_png);
-    printf("IDAT CRC VALUE %08X\n",test->p_IDAT->crc);
-	
-#if 0
-	printf("\nIDAT: p_data: ");
-	/*for (U8 i = 0; i < test->p_IDAT->length; i++) {
-		printf("%02X", *(test->p_IDAT->p_data + i));
-	}*/
-	printf("\nIDAT: CRC: %08X\n", test->p_IDAT->crc);
-
-	printf("total length of p_data: %X\n", sizeof(test->p_IDAT->p_data));
-#endif
-	fwrite(&test->p_IEND->length, 1, CHUNK_LEN_SIZE, concatenated_png);
-	fwrite(&test->p_IEND->type, 1, CHUNK_TYPE_SIZE, concatenated_png);
-	fwrite(test->p_IEND->p_data, 1, test->p_IEND->length, concatenated_png);
-
-	test->p_IEND->crc = htonl(test->p_IEND->crc);
-	fwrite(&test->p_IEND->crc, 1, CHUNK_CRC_SIZE, concatenated_png);
+	U8 head[CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE];
+	if (fread(head, 1, sizeof(head), fp) != sizeof(head)) {
+		return -1;
+	}
+	*length = ((U32) head[0] << 24) | ((U32) head[1] << 16) | ((U32) head[2] << 8) | head[3];
+	memcpy(type, head + CHUNK_LEN_SIZE, CHUNK_TYPE_SIZE);
+	return 0;
 }
 
-int isPng(char *fullPath) {
-    //printf("isPng path: %s\n",fullPath);
-    FILE *png_file;
-    int trueFalse = 0;
-    unsigned char *bufferSize = malloc(8+1); // 8 bytes + 1 for the \0
-	memset(bufferSize, 0, 8 + 1);
-    png_file = fopen(fullPath, "r");
-    if ((png_file = fopen(fullPath, "r"))){
-        fread(bufferSize, 1, 4, png_file);
-        bufferSize[9] = '\0';
-        fclose(png_file);
-        if (bufferSize[1] == 'P' && bufferSize[2] == 'N' && bufferSize[3] == 'G') {
-            trueFalse = 1;
-        }
-    } else {
-        printf("Inexistant file: \"%s\". Please try again\n",fullPath);
-        exit(2);
-    }
-    free(bufferSize);
-    return trueFalse;
+/**
+ * @brief -s mode: push every input's scanlines through one deflate stream
+ *        that writes 256K IDATs as they fill. Only a few CHUNK sized
+ *        buffers, one scanline and the zlib state are ever in memory.
+ *        The output IHDR gets the total height from the header pre-pass.
+ * @return 0 on success, exits with 3 on bad input like the other modes
+ */
+int streamPngs(char **names, int count)
+{
+	struct png_out out;
+	FILE *in;
+	struct idat_writer iw;
+	struct data_IHDR first_iHDR;
+	struct data_IHDR cur_iHDR;
+	U8 ihdr[DATA_IHDR_SIZE];
+	U8 out_ihdr[DATA_IHDR_SIZE]; //queued until the first IDAT goes out, ihdr gets reused
+	U8 sig[PNG_SIG_SIZE];
+	U8 stored_crc[CHUNK_CRC_SIZE];
+	U8 type[CHUNK_TYPE_SIZE];
+	U32 length;
+	U32 totalHeight = 0;
+	struct crc_ctx ihdr_crc;
+
+	if (png_out_open(&out, "all.png") != 0) {
+		perror("all.png");
+		exit(3);
+	}
+	if (png_out_sig(&out) != 0) {
+		perror("all.png");
+		exit(3);
+	}
+	for (int i = 0; i < count; i++) {
+		in = fopen(names[i], "rb");
+		if (in == NULL || fread(sig, 1, PNG_SIG_SIZE, in) != PNG_SIG_SIZE || readChunkHead(in, &length, type) != 0 || length != DATA_IHDR_SIZE || memcmp(type, "IHDR", CHUNK_TYPE_SIZE) != 0 || fread(ihdr, 1, DATA_IHDR_SIZE, in) != DATA_IHDR_SIZE || fread(stored_crc, 1, CHUNK_CRC_SIZE, in) != CHUNK_CRC_SIZE) {
+			fprintf(stderr, "%s: can't read the IHDR chunk\n", names[i]);
+			exit(3);
+		}
+		crc_init(&ihdr_crc);
+		crc_update(&ihdr_crc, type, CHUNK_TYPE_SIZE);
+		crc_update(&ihdr_crc, ihdr, DATA_IHDR_SIZE);
+		checkCrc(stored_crc, &ihdr_crc, names[i]);
+
+		memcpy(&cur_iHDR.width, ihdr, 4);
+		cur_iHDR.width = ntohl(cur_iHDR.width);
+		memcpy(&cur_iHDR.height, ihdr + 4, 4);
+		cur_iHDR.height = ntohl(cur_iHDR.height);
+		cur_iHDR.bit_depth = ihdr[8];
+		cur_iHDR.color_type = ihdr[9];
+		cur_iHDR.compression = ihdr[10];
+		cur_iHDR.filter = ihdr[11];
+		cur_iHDR.interlace = ihdr[12];
+		if (cur_iHDR.interlace != 0 || png_stride(&cur_iHDR) == 0) {
+			fprintf(stderr, "%s: interlaced or bad color type, can't stream\n", names[i]);
+			exit(3);
+		}
+		if (i == 0) {
+			//the pre-pass already added up the height
+			first_iHDR = cur_iHDR;
+			totalHeight = htonl(g_planHeight);
+			memcpy(out_ihdr, ihdr, DATA_IHDR_SIZE);
+			memcpy(out_ihdr + 4, &totalHeight, 4);
+			if (png_out_chunk(&out, type, out_ihdr, DATA_IHDR_SIZE) != 0) {
+				perror("all.png");
+				exit(3);
+			}
+			if (idat_begin(&iw, &out, Z_DEFAULT_COMPRESSION) != 0) {
+				fprintf(stderr, "idat_begin failed\n");
+				exit(3);
+			}
+		}
+		else if (cur_iHDR.width != first_iHDR.width || cur_iHDR.bit_depth != first_iHDR.bit_depth || cur_iHDR.color_type != first_iHDR.color_type) {
+			fprintf(stderr, "%s: width or pixel format differs from %s\n", names[i], names[0]);
+			exit(3);
+		}
+		streamRows(in, names[i], &cur_iHDR, &iw, i == 0);
+		fclose(in);
+	}
+	if (count > 0) {
+		if (idat_end(&iw) != 0) {
+			fprintf(stderr, "all.png: writing IDAT failed\n");
+			exit(3);
+		}
+		if (writeKept(&out, g_nKeptBefore, g_nKept) != 0 || png_out_chunk(&out, (const U8 *) "IEND", NULL, 0) != 0) {
+			perror("all.png");
+			exit(3);
+		}
+	}
+	if (png_out_close(&out) != 0) {
+		perror("all.png");
+		exit(3);
+	}
+	arena_release(&g_arena);
+	return 0;
+}
+
+/**
+ * @brief inflate one input's IDAT chunks (however many) piece by piece
+ *        and hand the scanlines to the idat_writer. The first scanline
+ *        of every input but the first is held back until it is complete
+ *        so it can be detached from the row above.
+ */
+void streamRows(FILE *in, char *png_name, struct data_IHDR *p_iHDR, struct idat_writer *iw, int isFirst)
+{
+	U8 inBuf[CHUNK];
+	U8 outBuf[CHUNK];
+	U8 type[CHUNK_TYPE_SIZE];
+	U8 stored_crc[CHUNK_CRC_SIZE];
+	U32 length;
+	U64 rowSize = png_stride(p_iHDR);
+	U64 expected = rowSize * p_iHDR->height;
+	U64 got = 0;
+	U8 *row = NULL;
+	struct crc_ctx idat_crc;
+	struct arena scratch; //this input's first row and chunk data, gone when it is done
+	z_stream strm;
+	int ret = Z_OK;
+
+	arena_init(&scratch, 0);
+	if (isFirst == 0) {
+		row = arenaGet(&scratch, rowSize);
+	}
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit(&strm) != Z_OK) {
+		fprintf(stderr, "%s: inflateInit failed\n", png_name);
+		exit(3);
+	}
+	int idatState = 0; //0 before the IDATs, 1 in them, 2 after them
+	while (readChunkHead(in, &length, type) == 0 && memcmp(type, "IEND", CHUNK_TYPE_SIZE) != 0) {
+		if (memcmp(type, "IDAT", CHUNK_TYPE_SIZE) != 0) {
+			if (CHUNK_IS_ANCILLARY(type) && (isFirst == 0 || g_keepAncillary == 0)) {
+				fseek(in, (long) length + CHUNK_CRC_SIZE, SEEK_CUR); //not wanted
+				continue;
+			}
+			if (idatState == 1) {
+				idatState = 2;
+			}
+			//PLTE, unknown critical chunks or (-a) ancillary ones to keep
+			U8 *data = arenaGet(&scratch, length);
+			if (fread(data, 1, length, in) != length || fread(stored_crc, 1, CHUNK_CRC_SIZE, in) != CHUNK_CRC_SIZE) {
+				fprintf(stderr, "%s: %.4s chunk is cut short\n", png_name, (char *) type);
+				exit(3);
+			}
+			crc_init(&idat_crc);
+			crc_update(&idat_crc, type, CHUNK_TYPE_SIZE);
+			crc_update(&idat_crc, data, length);
+			checkCrc(stored_crc, &idat_crc, png_name);
+			keepChunk(type, data, length, idatState != 0, isFirst, png_name);
+			continue;
+		}
+		if (idatState == 2) {
+			fprintf(stderr, "%s: IDAT chunks are not consecutive\n", png_name);
+			exit(3);
+		}
+		if (idatState == 0 && isFirst == 1) {
+			//nothing has gone out since IHDR yet, the kept chunks go here
+			if (writeKept(iw->out, 0, g_nKeptBefore) != 0) {
+				perror("all.png");
+				exit(3);
+			}
+		}
+		idatState = 1;
+		crc_init(&idat_crc);
+		crc_update(&idat_crc, type, CHUNK_TYPE_SIZE);
+		while (length > 0) {
+			U32 n = fread(inBuf, 1, length < CHUNK ? length : CHUNK, in);
+			if (n == 0) {
+				fprintf(stderr, "%s: IDAT chunk is cut short\n", png_name);
+				exit(3);
+			}
+			crc_update(&idat_crc, inBuf, n);
+			length -= n;
+			strm.next_in = inBuf;
+			strm.avail_in = n;
+			//a full outBuf may mean more output is pending, go round again
+			do {
+				strm.next_out = outBuf;
+				strm.avail_out = CHUNK;
+				ret = inflate(&strm, Z_NO_FLUSH);
+				if (ret == Z_BUF_ERROR) { //no progress possible, needs more input
+					ret = Z_OK;
+					break;
+				}
+				if (ret != Z_OK && ret != Z_STREAM_END) {
+					fprintf(stderr, "%s: bad image data, inflate ret = %d\n", png_name, ret);
+					exit(3);
+				}
+				U64 have = CHUNK - strm.avail_out;
+				U8 *p = outBuf;
+				if (got + have > expected) {
+					fprintf(stderr, "%s: more image data than IHDR says\n", png_name);
+					exit(3);
+				}
+				if (row != NULL && got < rowSize) { //still collecting the first row
+					U64 take = rowSize - got < have ? rowSize - got : have;
+					memcpy(row + got, p, take);
+					got += take;
+					p += take;
+					have -= take;
+					if (got == rowSize) {
+						if (png_detach_first_row(row, p_iHDR) != 0 || idat_write(iw, row, rowSize) != 0) {
+							fprintf(stderr, "%s: bad filter type or write error\n", png_name);
+							exit(3);
+						}
+					}
+				}
+				if (have > 0 && idat_write(iw, p, have) != 0) {
+					fprintf(stderr, "all.png: write error\n");
+					exit(3);
+				}
+				got += have;
+			} while ((strm.avail_in > 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
+		}
+		if (fread(stored_crc, 1, CHUNK_CRC_SIZE, in) != CHUNK_CRC_SIZE) {
+			fprintf(stderr, "%s: IDAT chunk is cut short\n", png_name);
+			exit(3);
+		}
+		checkCrc(stored_crc, &idat_crc, png_name);
+	}
+	if (ret != Z_STREAM_END || got != expected) {
+		fprintf(stderr, "%s: image data ends early\n", png_name);
+		exit(3);
+	}
+	inflateEnd(&strm);
+	arena_release(&scratch);
+}
+
+/**
+ * @brief milliseconds on a monotonic clock, for the -v report
+ */
+double nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * @brief deflate all of g_rows into dest, on g_jobs threads if -j was given
+ */
+int deflateRows(U8 *dest, U64 *destLength)
+{
+	if (g_jobs > 0) {
+		return mem_def_parallel(dest, destLength, g_rows, g_rowsLen, Z_DEFAULT_COMPRESSION, g_jobs);
+	}
+	return mem_def(dest, destLength, g_rows, g_rowsLen, Z_DEFAULT_COMPRESSION);
+}
+
+/**
+ * @brief the header pre-pass: read the signature and IHDR of every input
+ *        (33 bytes each, nothing else) and check that they can be stacked:
+ *        same width and pixel format, not interlaced. Fills g_plan and
+ *        the output's exact height and scanline size.
+ * @return 0 if they can, -1 if one is not a PNG file; exits with 2 if an
+ *         input can't be read and with 3 if the inputs don't fit together
+ */
+int planInputs(char **names, int count)
+{
+	unsigned long fileSize;
+	U64 height = 0;
+
+	g_plan = arenaGet(&g_arena, count * sizeof(struct data_IHDR));
+	for (int i = 0; i < count; i++) {
+		struct data_IHDR *h = &g_plan[i];
+		switch (png_read_header(names[i], h, &fileSize)) {
+		case 0:
+			break;
+		case -1:
+			printf("Inexistant file: \"%s\". Please try again\n", names[i]);
+			exit(2);
+		case -2:
+			return -1;
+		default:
+			fprintf(stderr, "%s: no valid IHDR chunk, file is corrupt\n", names[i]);
+			exit(3);
+		}
+		if (png_stride(h) == 0 || h->compression != 0 || h->filter != 0) {
+			fprintf(stderr, "%s: bad color type, bit depth or method in IHDR\n", names[i]);
+			exit(3);
+		}
+		if (h->interlace != 0) {
+			fprintf(stderr, "%s: interlaced images can't be stacked\n", names[i]);
+			exit(3);
+		}
+		if (i > 0 && (h->width != g_plan[0].width || h->bit_depth != g_plan[0].bit_depth || h->color_type != g_plan[0].color_type)) {
+			fprintf(stderr, "%s: width or pixel format differs from %s\n", names[i], names[0]);
+			exit(3);
+		}
+		height += h->height;
+		g_planFiles += fileSize;
+	}
+	if (height > 0x7fffffffU) { //the PNG limit
+		fprintf(stderr, "the inputs are %llu rows high together, too many for one PNG\n", (unsigned long long) height);
+		exit(3);
+	}
+	g_planHeight = height;
+	if (count > 0) {
+		g_planRaw = png_stride(&g_plan[0]) * height;
+	}
+	return 0;
 }
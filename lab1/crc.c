@@ -2,31 +2,227 @@
  * @file: crc.c
  * @brief: PNG crc calculation
  * Reference: https://www.w3.org/TR/PNG-CRCAppendix.html
+ *
+ * The inner loop uses the "slicing-by-N" technique: N tables are
+ * derived from the byte-wise table (see crc_gen.c) so that N input
+ * bytes can be folded into the running CRC with N independent table
+ * lookups per iteration.
+ * Select the width at build time with -DCRC_SLICE=1, 8 or 16
+ * (1 is the original byte-at-a-time loop). Defaults to 8.
+ *
+ * On x86 CPUs with PCLMULQDQ, buffers of 64 bytes or more are instead
+ * folded 64 bytes at a time with carry-less multiplies (Intel, "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction").
+ * The kernel is picked once at program start from CPUID; build with
+ * -DCRC_NO_CLMUL to always use the table path.
  */
 
-/* Table of CRCs of all 8-bit messages. */
-unsigned long crc_table[256];
+#define _POSIX_C_SOURCE 200112L /* for sysconf() */
 
-/* Flag: has the table been computed? Initially false. */
-int crc_table_computed = 0;
+#include <pthread.h>  /* for pthread_create(), pthread_join() */
+#include <unistd.h>   /* for sysconf()                        */
+#include "crc.h"
 
-/* Make the table for a fast CRC. */
-void make_crc_table(void)
+#if !defined(CRC_NO_CLMUL) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CRC_CLMUL 1
+#include <wmmintrin.h> /* for _mm_clmulepi64_si128() */
+#include <smmintrin.h> /* for _mm_extract_epi32()    */
+#endif
+
+#ifndef CRC_SLICE
+#define CRC_SLICE 8
+#endif
+
+#if CRC_SLICE != 1 && CRC_SLICE != 8 && CRC_SLICE != 16
+#error "CRC_SLICE must be 1, 8 or 16"
+#endif
+
+/* Tables of CRCs of all 8-bit messages, crc_table[0] is the byte-wise
+   table, crc_table[k][n] is the CRC of byte n followed by k zero bytes.
+   Generated at build time by crc_gen.c, so there is no lazy
+   initialization and the routines below are safe to call from any
+   thread without locking. */
+#include "crc_table.h"
+
+#if CRC_SLICE > 1
+/* Read four bytes as a little endian word, independent of host order. */
+static unsigned int load_le32(const unsigned char *p)
+{
+    return (unsigned int) p[0] | ((unsigned int) p[1] << 8) |
+           ((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+#endif
+
+/* Table driven update of the running CRC c with buf[0..len-1]. */
+static unsigned int update_crc_table(unsigned int c, const unsigned char *buf,
+                                     int len)
 {
-    unsigned long c;
-    int n, k;
+    int n = 0;
+
+#if CRC_SLICE == 16
+    {
+        const unsigned int (*t)[256] = crc_table;
+
+        for (; n + 16 <= len; n += 16) {
+            unsigned int w0 = load_le32(buf + n) ^ c;
+            unsigned int w1 = load_le32(buf + n + 4);
+            unsigned int w2 = load_le32(buf + n + 8);
+            unsigned int w3 = load_le32(buf + n + 12);
+
+            c = t[15][w0 & 0xff] ^ t[14][(w0 >> 8) & 0xff] ^
+                t[13][(w0 >> 16) & 0xff] ^ t[12][w0 >> 24] ^
+                t[11][w1 & 0xff] ^ t[10][(w1 >> 8) & 0xff] ^
+                t[9][(w1 >> 16) & 0xff] ^ t[8][w1 >> 24] ^
+                t[7][w2 & 0xff] ^ t[6][(w2 >> 8) & 0xff] ^
+                t[5][(w2 >> 16) & 0xff] ^ t[4][w2 >> 24] ^
+                t[3][w3 & 0xff] ^ t[2][(w3 >> 8) & 0xff] ^
+                t[1][(w3 >> 16) & 0xff] ^ t[0][w3 >> 24];
+        }
+    }
+#elif CRC_SLICE == 8
+    {
+        const unsigned int (*t)[256] = crc_table;
+
+        for (; n + 8 <= len; n += 8) {
+            unsigned int w0 = load_le32(buf + n) ^ c;
+            unsigned int w1 = load_le32(buf + n + 4);
 
-    for (n = 0; n < 256; n++) {
-        c = (unsigned long) n;
-        for (k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
+            c = t[7][w0 & 0xff] ^ t[6][(w0 >> 8) & 0xff] ^
+                t[5][(w0 >> 16) & 0xff] ^ t[4][w0 >> 24] ^
+                t[3][w1 & 0xff] ^ t[2][(w1 >> 8) & 0xff] ^
+                t[1][(w1 >> 16) & 0xff] ^ t[0][w1 >> 24];
         }
-        crc_table[n] = c;
     }
-    crc_table_computed = 1;
+#endif
+    /* byte-wise tail, or the whole buffer when CRC_SLICE is 1 */
+    for (; n < len; n++) {
+        c = crc_table[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    }
+    return c;
+}
+
+#ifdef CRC_CLMUL
+/* Fold len bytes of buf into the running CRC c, len >= 64 and a multiple
+   of 16. Constants are x^(k) mod P(x), bit reflected, for the PNG/zlib
+   polynomial 0xedb88320, followed by the Barrett reduction constants. */
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int fold_crc_clmul(unsigned int c, const unsigned char *buf,
+                                   int len)
+{
+    static const unsigned long long k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL }; /* fold by 512 bits */
+    static const unsigned long long k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL }; /* fold by 128 bits */
+    static const unsigned long long k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL }; /* fold 64 to 32 bits */
+    static const unsigned long long poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL }; /* P(x) and mu */
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) c));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* four independent 128 bit lanes, folded 64 bytes at a time */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *) (buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *) (buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *) (buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *) (buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining 16 byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *) buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned int) _mm_extract_epi32(x1, 1);
+}
+
+/* Carry-less multiply path, short buffers and the tail use the tables. */
+static unsigned int update_crc_clmul(unsigned int c, const unsigned char *buf,
+                                     int len)
+{
+    if (len >= 64) {
+        int bulk = len & ~15;
+
+        c = fold_crc_clmul(c, buf, bulk);
+        buf += bulk;
+        len -= bulk;
+    }
+    return update_crc_table(c, buf, len);
+}
+#endif /* CRC_CLMUL */
+
+/* CRC kernel used by update_crc(), chosen once by select_crc_kernel(). */
+static unsigned int (*crc_kernel)(unsigned int, const unsigned char *, int) =
+    update_crc_table;
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void select_crc_kernel(void)
+{
+#ifdef CRC_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        crc_kernel = update_crc_clmul;
+#endif
 }
 
 /* Update a running CRC with the bytes buf[0..len-1]--the CRC
@@ -36,19 +232,199 @@ void make_crc_table(void)
 
 unsigned long update_crc(unsigned long crc, unsigned char *buf, int len)
 {
-    unsigned long c = crc;
+    return crc_kernel((unsigned int) crc, buf, len);
+}
+
+/* Return the CRC of the bytes buf[0..len-1]. */
+unsigned long crc(unsigned char *buf, int len)
+{
+    return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
+}
+
+/* Start a running CRC, feed it with crc_update() as the data is
+   produced and read the result with crc_final(); equivalent to crc()
+   over the concatenation of all the pieces. */
+void crc_init(struct crc_ctx *ctx)
+{
+    ctx->crc = 0xffffffffL;
+}
+
+void crc_update(struct crc_ctx *ctx, unsigned char *buf, int len)
+{
+    ctx->crc = update_crc(ctx->crc, buf, len);
+}
+
+unsigned long crc_final(struct crc_ctx *ctx)
+{
+    return ctx->crc ^ 0xffffffffL;
+}
+
+/* Number of bits in a CRC, the size of the GF(2) operator matrices below. */
+#define GF2_DIM 32
+
+/* Multiply the 32x32 GF(2) matrix mat by the bit vector vec. */
+static unsigned long gf2_matrix_times(const unsigned long *mat,
+                                      unsigned long vec)
+{
+    unsigned long sum = 0;
+
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+/* square = mat * mat */
+static void gf2_matrix_square(unsigned long *square, const unsigned long *mat)
+{
     int n;
 
-    if (!crc_table_computed)
-        make_crc_table();
-    for (n = 0; n < len; n++) {
-        c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    for (n = 0; n < GF2_DIM; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Return the CRC of the concatenation A|B given crc_a = crc(A),
+   crc_b = crc(B) and len_b, the length of B. Appending len_b zero bytes
+   to A is a linear operator on the CRC register, applied here by
+   repeated squaring of the one-zero-bit operator (as in zlib's
+   crc32_combine()), so neither A nor B is read again. */
+unsigned long crc_combine(unsigned long crc_a, unsigned long crc_b,
+                          unsigned long len_b)
+{
+    unsigned long even[GF2_DIM]; /* even-power-of-two zeros operator */
+    unsigned long odd[GF2_DIM];  /* odd-power-of-two zeros operator  */
+    unsigned long row;
+    int n;
+
+    if (len_b == 0)
+        return crc_a;
+
+    /* operator for one zero bit in odd */
+    odd[0] = 0xedb88320L;
+    row = 1;
+    for (n = 1; n < GF2_DIM; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); /* two zero bits  */
+    gf2_matrix_square(odd, even); /* four zero bits */
+
+    /* apply len_b zero bytes to crc_a, the first squaring gives the
+       operator for one zero byte (eight zero bits) in even */
+    do {
+        gf2_matrix_square(even, odd);
+        if (len_b & 1)
+            crc_a = gf2_matrix_times(even, crc_a);
+        len_b >>= 1;
+        if (len_b == 0)
+            break;
+
+        gf2_matrix_square(odd, even);
+        if (len_b & 1)
+            crc_a = gf2_matrix_times(odd, crc_a);
+        len_b >>= 1;
+    } while (len_b != 0);
+
+    return crc_a ^ crc_b;
+}
+
+/* one segment of a crc_parallel() job */
+struct crc_seg {
+    unsigned char *buf;
+    unsigned long len;
+    unsigned long crc; /* crc() of buf[0..len-1], set by the worker */
+};
+
+/* crc() of one segment, split so the int length of update_crc() is safe */
+static unsigned long crc_long(unsigned char *buf, unsigned long len)
+{
+    unsigned long c = 0xffffffffL;
+
+    while (len > 0) {
+        int n = len > 0x40000000UL ? 0x40000000 : (int) len;
+
+        c = update_crc(c, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return c ^ 0xffffffffL;
+}
+
+static void *crc_seg_worker(void *arg)
+{
+    struct crc_seg *seg = arg;
+
+    seg->crc = crc_long(seg->buf, seg->len);
+    return NULL;
+}
+
+/**
+ * @brief: CRC of a large buffer computed on several threads
+ * @param: buf, len  the data
+ * @param: nthreads  number of threads to use, <= 0 for one per online CPU
+ * @return the same value as crc(buf, len)
+ * NOTE: the buffer is cut into one segment per thread, no segment
+ *       smaller than CRC_PARALLEL_SEG bytes; the segment CRCs are joined
+ *       with crc_combine(). Below 2 * CRC_PARALLEL_SEG bytes, or if a
+ *       thread cannot be started, the work is done on the calling thread.
+ */
+unsigned long crc_parallel(unsigned char *buf, unsigned long len, int nthreads)
+{
+    struct crc_seg seg[CRC_PARALLEL_MAX];
+    pthread_t tid[CRC_PARALLEL_MAX];
+    unsigned long seg_len, off, c;
+    int nseg, started, i;
+
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (int) ncpu : 1;
+    }
+    if (nthreads > CRC_PARALLEL_MAX) {
+        nthreads = CRC_PARALLEL_MAX;
+    }
+    nseg = len / CRC_PARALLEL_SEG < (unsigned long) nthreads ?
+           (int) (len / CRC_PARALLEL_SEG) : nthreads;
+    if (nseg < 2) {
+        return crc_long(buf, len);
+    }
+
+    seg_len = len / nseg;
+    for (i = 0, off = 0; i < nseg; i++, off += seg_len) {
+        seg[i].buf = buf + off;
+        seg[i].len = (i == nseg - 1) ? len - off : seg_len;
+    }
+
+    /* segment 0 runs on the calling thread */
+    for (started = 1; started < nseg; started++) {
+        if (pthread_create(&tid[started], NULL, crc_seg_worker, &seg[started]) != 0) {
+            break;
+        }
+    }
+    crc_seg_worker(&seg[0]);
+    for (i = started; i < nseg; i++) {
+        crc_seg_worker(&seg[i]);
+    }
+    for (i = 1; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    c = seg[0].crc;
+    for (i = 1; i < nseg; i++) {
+        c = crc_combine(c, seg[i].crc, seg[i].len);
     }
     return c;
 }
 
-/* Return the CRC of the bytes buf[0..len-1]. */
-unsigned long crc(unsigned char *buf, int len)
+/* crc_update() for large pieces, spreads the work over nthreads threads
+   with crc_parallel() and joins the result onto the running CRC */
+void crc_update_parallel(struct crc_ctx *ctx, unsigned char *buf,
+                         unsigned long len, int nthreads)
 {
-    return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
+    unsigned long c = crc_combine(crc_final(ctx),
+                                  crc_parallel(buf, len, nthreads), len);
+
+    ctx->crc = c ^ 0xffffffffL;
 }
@@ -5,6 +5,21 @@
 
 #pragma once
 
-void make_crc_table(void);
+#define CRC_PARALLEL_SEG (4UL << 20) /* smallest crc_parallel() segment */
+#define CRC_PARALLEL_MAX 64          /* most threads crc_parallel() uses */
+
+/* running CRC of a byte stream that arrives in pieces */
+typedef struct crc_ctx {
+    unsigned long crc; /* CRC register, pre-conditioned to all 1's */
+} *crc_ctx_p;
+
 unsigned long update_crc(unsigned long crc, unsigned char *buf, int len);
 unsigned long crc(unsigned char *buf, int len);
+unsigned long crc_combine(unsigned long crc_a, unsigned long crc_b,
+                          unsigned long len_b);
+void crc_init(struct crc_ctx *ctx);
+void crc_update(struct crc_ctx *ctx, unsigned char *buf, int len);
+unsigned long crc_final(struct crc_ctx *ctx);
+unsigned long crc_parallel(unsigned char *buf, unsigned long len, int nthreads);
+void crc_update_parallel(struct crc_ctx *ctx, unsigned char *buf,
+                         unsigned long len, int nthreads);
@@ -0,0 +1,52 @@
+/********************************************************************
+ * @file: crc_gen.c
+ * @brief: generates crc_table.h, the constant lookup tables for crc.c
+ * Usage: ./crc_gen.out > crc_table.h (see the crc_table.h make target)
+ *
+ * crc_table[0] is the byte-wise table of the PNG CRC appendix,
+ * crc_table[k][n] is the CRC register after byte n followed by k zero
+ * bytes, as used by the slicing-by-8/16 loop.
+ */
+
+#include <stdio.h>
+
+#define CRC_TABLES 16 /* enough for the widest CRC_SLICE */
+
+int main(void)
+{
+    static unsigned long table[CRC_TABLES][256];
+    unsigned long c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (unsigned long) n;
+        for (k = 0; k < 8; k++) {
+            if (c & 1)
+                c = 0xedb88320L ^ (c >> 1);
+            else
+                c = c >> 1;
+        }
+        table[0][n] = c;
+    }
+    for (k = 1; k < CRC_TABLES; k++) {
+        for (n = 0; n < 256; n++) {
+            c = table[k - 1][n];
+            table[k][n] = table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+
+    printf("/* crc_table.h -- generated by crc_gen.c, do not edit */\n\n");
+    printf("#pragma once\n\n");
+    printf("#define CRC_TABLES %d\n\n", CRC_TABLES);
+    printf("static const unsigned int crc_table[CRC_TABLES][256] = {\n");
+    for (k = 0; k < CRC_TABLES; k++) {
+        printf("  {\n");
+        for (n = 0; n < 256; n++) {
+            printf("%s0x%08lxU%s", n % 6 == 0 ? "    " : "", table[k][n],
+                   n == 255 ? "\n" : (n % 6 == 5 ? ",\n" : ", "));
+        }
+        printf("  }%s\n", k == CRC_TABLES - 1 ? "" : ",");
+    }
+    printf("};\n");
+    return 0;
+}
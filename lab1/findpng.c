@@ -9,6 +9,7 @@
 #include <sys/stat.h> /* stats of data i.e. last access , READ MAN*/
 #include <unistd.h>   /* for standard symbolic constants and types*/
 #include <string.h>
+#include "lab_png.h"  /* for png_map_file(), png_view_parse() */
 
 
 int findPng(char *, int);
@@ -53,11 +54,13 @@ int findPng(char *parent, int count) {
         return(2);
     }
     struct dirent *p_dirent;
-    p_dirent = readdir(curr_dir); /* Not displaying current directory "." */
-    p_dirent = readdir(curr_dir);  /*Not displaying parent directory ".." */
     int i = 0;
     while((p_dirent = readdir(curr_dir)) != NULL) {
         char *str_path = p_dirent->d_name;  /* relative path name! */
+        /* "." and ".." can come anywhere in readdir() order, not just first */
+        if (strcmp(str_path, ".") == 0 || strcmp(str_path, "..") == 0) {
+            continue;
+        }
         //printf("In while loop %i: %s\n",i,parent);
         i++;
         if (str_path == NULL) {
@@ -97,18 +100,19 @@ int fileType(char *fileName, char *parentDirectory, int count){
 
 int isPng(char *fullPath) {
     //printf("isPng path: %s\n",fullPath);
-    FILE *png_file;
+    struct png_map map;
+    struct png_view pv;
     int trueFalse = 0;
-    unsigned char *bufferSize = malloc(8+1); // 8 bytes + 1 for the \0
 
-    png_file = fopen(fullPath, "r");
-    fread(bufferSize, 1, 4, png_file);
-    bufferSize[9] = '\0';
-    fclose(png_file);
-    if(bufferSize[1] == 'P' && bufferSize[2] == 'N' && bufferSize[3] == 'G') {
+    //only the signature and IHDR are looked at, the rest of the mapping
+    //is never touched (so never read from disk)
+    if (png_map_file(&map, fullPath) != 0) {
+        return 0;
+    }
+    //-1 is no PNG signature; a corrupt IHDR is still a PNG file here
+    if (png_view_parse(&pv, map.buf, map.size, PNG_VIEW_HEADER_ONLY) != -1) {
         trueFalse = 1;
     }
-    free(bufferSize);
+    png_unmap(&map);
     return trueFalse;
 }
-
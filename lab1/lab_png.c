@@ -0,0 +1,867 @@
+/**
+ * @brief: PNG chunk routines: finding the chunks of a file held in memory
+ *         (png_view), vectored output of chunks (png_out) and IDAT
+ *         streaming (idat_writer), plus the scanline sizes they share
+ * NOTES: a chunk is length (4 bytes, big endian), type (4 bytes), data
+ *        and the CRC of type and data (4 bytes, big endian), see
+ *        https://www.w3.org/TR/PNG-Structure.html
+ */
+
+#define _GNU_SOURCE /* for fallocate(), pwritev(), posix_madvise() */
+
+#include <stdio.h>
+#include <stdlib.h>   /* for malloc(), free() */
+#include <string.h>   /* for memcmp()         */
+#include <errno.h>    /* for errno            */
+#include <fcntl.h>    /* for open(), fallocate() */
+#include <unistd.h>   /* for read(), close()  */
+#include <sys/uio.h>  /* for pwritev()        */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * VECTORED OUTPUT
+ * A png_out never copies chunk data. Each chunk is queued as its data
+ * (borrowed, it must stay put until the next flush) with the fields
+ * around it in small glue segments: the CRC of one chunk and the length
+ * and type of the next share a segment, as do the signature and IHDR's
+ * length and type. A catpng output with no PLTE or ancillary chunks
+ * is 5 segments and one pwritev().
+ *****************************************************************************/
+
+/* append n bytes of fields to the last glue segment, or start a new one */
+static int png_out_glue(struct png_out *p_po, const U8 *bytes, U32 n)
+{
+    struct iovec *seg;
+
+    if (p_po->glue == NULL || p_po->segs[p_po->nsegs - 1].iov_len + n > PNG_OUT_GLUE) {
+        if (p_po->nsegs == PNG_OUT_SEGS && png_out_flush(p_po) != 0) {
+            return -1;
+        }
+        p_po->glue = arena_alloc(&p_po->fields, PNG_OUT_GLUE);
+        if (p_po->glue == NULL) {
+            return -1;
+        }
+        seg = &p_po->segs[p_po->nsegs++];
+        seg->iov_base = p_po->glue;
+        seg->iov_len = 0;
+    }
+    seg = &p_po->segs[p_po->nsegs - 1];
+    memcpy(p_po->glue + seg->iov_len, bytes, n);
+    seg->iov_len += n;
+    p_po->queued += n;
+    return 0;
+}
+
+/* store a 32 bit value in network (big endian) byte order */
+static void put_u32_be(U8 *p, U32 val)
+{
+    p[0] = (val >> 24) & 0xff;
+    p[1] = (val >> 16) & 0xff;
+    p[2] = (val >> 8) & 0xff;
+    p[3] = val & 0xff;
+}
+
+/* queue len bytes of borrowed data as a segment of their own */
+static int png_out_seg(struct png_out *p_po, const U8 *data, unsigned long len)
+{
+    if (p_po->nsegs == PNG_OUT_SEGS && png_out_flush(p_po) != 0) {
+        return -1;
+    }
+    p_po->segs[p_po->nsegs].iov_base = (U8 *) data;
+    p_po->segs[p_po->nsegs].iov_len = len;
+    p_po->nsegs++;
+    p_po->queued += len;
+    p_po->glue = NULL;
+    return 0;
+}
+
+/**
+ * @brief: create (or truncate) a file to write a PNG to with png_out
+ * @param: p_po struct png_out* writer state, caller supplies
+ * @param: path const char* output file
+ * @return =0 on success, <>0 if the file can't be opened, errno is set
+ */
+int png_out_open(struct png_out *p_po, const char *path)
+{
+    p_po->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    p_po->offset = 0;
+    p_po->queued = 0;
+    p_po->nthreads = 1;
+    p_po->nsegs = 0;
+    p_po->glue = NULL;
+    arena_init(&p_po->fields, PNG_OUT_SEGS * PNG_OUT_GLUE);
+    return p_po->fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief: queue the 8 byte PNG file signature
+ * @return =0 on success, <>0 on error
+ */
+int png_out_sig(struct png_out *p_po)
+{
+    static const U8 sig[PNG_SIG_SIZE] = {
+        0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+    };
+
+    return png_out_glue(p_po, sig, PNG_SIG_SIZE);
+}
+
+/**
+ * @brief: queue a whole chunk, computing its CRC now
+ * @param: p_po struct png_out* the writer
+ * @param: type const U8* 4 byte chunk type, e.g. "IDAT"
+ * @param: data const U8* chunk data, NULL if length is 0
+ * @param: length U32 data length, host byte order
+ * @return =0 on success, <>0 on error
+ * NOTE: data is not copied, it has to stay unchanged until the next
+ *       png_out_flush() (or png_out_close()).
+ */
+int png_out_chunk(struct png_out *p_po, const U8 *type, const U8 *data, U32 length)
+{
+    struct crc_ctx crc;
+    U8 head[CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE];
+    U8 tail[CHUNK_CRC_SIZE];
+
+    put_u32_be(head, length);
+    memcpy(head + CHUNK_LEN_SIZE, type, CHUNK_TYPE_SIZE);
+    if (png_out_glue(p_po, head, sizeof(head)) != 0) {
+        return -1;
+    }
+    crc_init(&crc);
+    crc_update(&crc, (U8 *) type, CHUNK_TYPE_SIZE);
+    if (length > 0) {
+        if (p_po->nthreads != 1 && length >= 2 * CRC_PARALLEL_SEG) {
+            crc_update_parallel(&crc, (U8 *) data, length, p_po->nthreads);
+        } else {
+            crc_update(&crc, (U8 *) data, length);
+        }
+        if (png_out_seg(p_po, data, length) != 0) {
+            return -1;
+        }
+    }
+    put_u32_be(tail, crc_final(&crc));
+    return png_out_glue(p_po, tail, sizeof(tail));
+}
+
+/* samples per pixel, 1 for indexed-colour (the palette index); 0 for a
+   color type PNG does not define */
+static U32 png_channels(const struct data_IHDR *p_ihdr)
+{
+    switch (p_ihdr->color_type) {
+    case 0:
+    case 3:
+        return 1;
+    case 4:
+        return 2;
+    case 2:
+        return 3;
+    case 6:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief: queue the header of a raw pixel file, written instead of a PNG:
+ *         the header, then the image's rows one after another queued
+ *         with png_out_data(), then for indexed-colour images the palette
+ * @param: p_po struct png_out* the writer, nothing queued yet
+ * @param: p_ihdr const struct data_IHDR* the image's IHDR, host byte order
+ * @param: plte_len U32 bytes of palette after the rows, 0 if there is none
+ * @return =0 on success, <>0 on a bad color type or an error
+ * NOTE: the header is, with every number big endian as in PNG:
+ *        0  8  signature 0x89 'R' 'A' 'W' '\r' '\n' 0x1a '\n'
+ *        8  4  width in pixels
+ *       12  4  height in pixels
+ *       16  4  bytes per row, png_stride() - 1: rows are not filtered,
+ *              have no filter type byte and start on a byte boundary
+ *       20  1  channels, 1 to 4
+ *       21  1  bit depth, 16 bit samples stay big endian
+ *       22  1  color type, as in IHDR
+ *       23  1  0
+ *       24  4  bytes of palette after the rows, 0 unless color type is 3
+ *       28  4  0
+ *       Row y starts at RAW_HEADER_SIZE + y * (bytes per row), so the
+ *       file can be mapped and used without decoding anything.
+ */
+int png_out_raw_header(struct png_out *p_po, const struct data_IHDR *p_ihdr,
+                       U32 plte_len)
+{
+    static const U8 sig[RAW_SIG_SIZE] = {
+        0x89, 0x52, 0x41, 0x57, 0x0D, 0x0A, 0x1A, 0x0A
+    };
+    unsigned long stride = png_stride(p_ihdr);
+    U8 *head;
+
+    if (stride == 0 || p_po->offset + p_po->queued != 0) {
+        return -1;
+    }
+    head = arena_calloc(&p_po->fields, RAW_HEADER_SIZE);
+    if (head == NULL) {
+        return -1;
+    }
+    memcpy(head, sig, RAW_SIG_SIZE);
+    put_u32_be(head + 8, p_ihdr->width);
+    put_u32_be(head + 12, p_ihdr->height);
+    put_u32_be(head + 16, stride - 1);
+    head[20] = png_channels(p_ihdr);
+    head[21] = p_ihdr->bit_depth;
+    head[22] = p_ihdr->color_type;
+    put_u32_be(head + 24, p_ihdr->color_type == 3 ? plte_len : 0);
+    return png_out_seg(p_po, head, RAW_HEADER_SIZE);
+}
+
+/**
+ * @brief: queue bytes to go out as they are, e.g. the rows of a raw
+ *         pixel file
+ * @return =0 on success, <>0 on error
+ * NOTE: data is borrowed as with png_out_chunk().
+ */
+int png_out_data(struct png_out *p_po, const U8 *data, unsigned long len)
+{
+    return len > 0 ? png_out_seg(p_po, data, len) : 0;
+}
+
+/**
+ * @brief: write everything queued, normally with a single pwritev();
+ *         the file is first extended to its new size in one go
+ * @return =0 on success, <>0 on a write error
+ */
+int png_out_flush(struct png_out *p_po)
+{
+    struct iovec *seg = p_po->segs;
+    int nsegs = p_po->nsegs;
+
+    if (p_po->queued == 0) {
+        p_po->nsegs = 0;
+        p_po->glue = NULL;
+        return 0;
+    }
+#ifdef __linux__
+    /* one extent allocation instead of one per write-back; a file system
+       without fallocate() support just doesn't get the hint */
+    (void) fallocate(p_po->fd, 0, p_po->offset, p_po->queued);
+#endif
+    while (nsegs > 0) {
+        ssize_t n = pwritev(p_po->fd, seg, nsegs, p_po->offset);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p_po->offset += n;
+        p_po->queued -= n;
+        /* a short write: skip what went out, resume mid-segment */
+        while (nsegs > 0 && (size_t) n >= seg->iov_len) {
+            n -= seg->iov_len;
+            seg++;
+            nsegs--;
+        }
+        if (nsegs > 0) {
+            seg->iov_base = (U8 *) seg->iov_base + n;
+            seg->iov_len -= n;
+        }
+    }
+    p_po->nsegs = 0;
+    p_po->glue = NULL;
+    arena_reset(&p_po->fields);
+    return 0;
+}
+
+/**
+ * @brief: write everything still queued and close the file; the writer
+ *         is released also on error
+ * @return =0 on success, <>0 on a write error
+ */
+int png_out_close(struct png_out *p_po)
+{
+    int ret = png_out_flush(p_po);
+
+    arena_release(&p_po->fields);
+    if (close(p_po->fd) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* bits per pixel for a color type and bit depth, 0 if the PNG spec does
+   not allow the combination */
+static U32 png_pixel_bits(U8 color_type, U8 bit_depth)
+{
+    switch (color_type) {
+    case 0:                                    /* greyscale            */
+        return (bit_depth == 1 || bit_depth == 2 || bit_depth == 4 ||
+                bit_depth == 8 || bit_depth == 16) ? bit_depth : 0;
+    case 3:                                    /* indexed-colour       */
+        return (bit_depth == 1 || bit_depth == 2 || bit_depth == 4 ||
+                bit_depth == 8) ? bit_depth : 0;
+    case 2:                                    /* truecolour           */
+        return (bit_depth == 8 || bit_depth == 16) ? 3 * bit_depth : 0;
+    case 4:                                    /* greyscale with alpha */
+        return (bit_depth == 8 || bit_depth == 16) ? 2 * bit_depth : 0;
+    case 6:                                    /* truecolour with alpha */
+        return (bit_depth == 8 || bit_depth == 16) ? 4 * bit_depth : 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief: bytes per complete pixel, rounded up to 1 for bit depths below
+ *         8; the distance the Sub, Avg and Paeth filters look back
+ * @return 1 to 8, or 0 for a color type and bit depth PNG does not allow
+ */
+U32 png_bpp(const struct data_IHDR *p_ihdr)
+{
+    return (png_pixel_bits(p_ihdr->color_type, p_ihdr->bit_depth) + 7) / 8;
+}
+
+/**
+ * @brief: bytes per scanline of (filtered) image data, the filter type
+ *         byte included, so inflated image data is exactly this times the
+ *         height; uses width, bit_depth and color_type of p_ihdr
+ * @return the row stride, 0 for a color type and bit depth PNG does not
+ *         allow
+ */
+unsigned long png_stride(const struct data_IHDR *p_ihdr)
+{
+    U32 bits = png_pixel_bits(p_ihdr->color_type, p_ihdr->bit_depth);
+
+    if (bits == 0) {
+        return 0;
+    }
+    return 1 + ((unsigned long) p_ihdr->width * bits + 7) / 8;
+}
+
+/**
+ * @brief: rewrite the first scanline of inflated image data so that its
+ *         filter no longer refers to the row above. In its own image that
+ *         row is all zeros, stacked under another image it is not.
+ * @param: rows U8* inflated image data, filter byte first
+ * @param: p_ihdr const struct data_IHDR* the image's IHDR
+ * @return =0 on success, <>0 on an unknown color type or filter
+ * NOTE: with a zero row above, Up is None and Paeth is Sub, so only Avg
+ *       needs its bytes reconstructed.
+ */
+int png_detach_first_row(U8 *rows, const struct data_IHDR *p_ihdr)
+{
+    U32 bpp = png_bpp(p_ihdr);
+    unsigned long len = png_stride(p_ihdr);
+    U8 *row = rows + 1;
+    unsigned long i;
+
+    if (len == 0) {
+        return -1;
+    }
+    len--;                               /* pixel bytes after the filter */
+    switch (rows[0]) {
+    case PNG_FILTER_NONE:
+    case PNG_FILTER_SUB:
+        break;
+    case PNG_FILTER_UP:
+        rows[0] = PNG_FILTER_NONE;
+        break;
+    case PNG_FILTER_PAETH:
+        rows[0] = PNG_FILTER_SUB;
+        break;
+    case PNG_FILTER_AVG:
+        for (i = bpp; i < len; i++) {
+            row[i] += row[i - bpp] >> 1;
+        }
+        rows[0] = PNG_FILTER_NONE;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/* write out the IDAT being filled if it holds anything */
+static int idat_flush(struct idat_writer *p_iw)
+{
+    U32 len = IDAT_CHUNK_SIZE - p_iw->strm.avail_out;
+
+    if (len > 0) {
+        /* buf is filled again right away, so it goes out now, along
+           with anything queued before it */
+        if (png_out_chunk(p_iw->out, (const U8 *) "IDAT", p_iw->buf, len) != 0 ||
+            png_out_flush(p_iw->out) != 0) {
+            return -1;
+        }
+        p_iw->nchunks++;
+    }
+    p_iw->strm.next_out = p_iw->buf;
+    p_iw->strm.avail_out = IDAT_CHUNK_SIZE;
+    return 0;
+}
+
+/**
+ * @brief: start writing image data through an idat_writer
+ * @param: p_iw struct idat_writer* writer state, caller supplies
+ * @param: out struct png_out* output file, the IDATs are queued after
+ *         what is already there
+ * @param: level int zlib compression level
+ * @return =0 on success, <>0 if out of memory
+ */
+int idat_begin(struct idat_writer *p_iw, struct png_out *out, int level)
+{
+    p_iw->out = out;
+    p_iw->nchunks = 0;
+    p_iw->buf = malloc(IDAT_CHUNK_SIZE);
+    if (p_iw->buf == NULL) {
+        return -1;
+    }
+    p_iw->strm.zalloc = Z_NULL;
+    p_iw->strm.zfree = Z_NULL;
+    p_iw->strm.opaque = Z_NULL;
+    if (deflateInit(&p_iw->strm, level) != Z_OK) {
+        free(p_iw->buf);
+        return -1;
+    }
+    p_iw->strm.next_out = p_iw->buf;
+    p_iw->strm.avail_out = IDAT_CHUNK_SIZE;
+    return 0;
+}
+
+/**
+ * @brief: deflate the next len bytes of (filtered) image data, writing an
+ *         IDAT every time IDAT_CHUNK_SIZE bytes of output have built up
+ * @return =0 on success, <>0 on a write or zlib error
+ */
+int idat_write(struct idat_writer *p_iw, const U8 *data, unsigned long len)
+{
+    while (len > 0) {
+        /* avail_in is 32 bits wide, very long pieces go in steps */
+        uInt step = len > 0x40000000UL ? 0x40000000U : (uInt) len;
+
+        p_iw->strm.next_in = (U8 *) data;
+        p_iw->strm.avail_in = step;
+        do {
+            if (deflate(&p_iw->strm, Z_NO_FLUSH) == Z_STREAM_ERROR) {
+                return -1;
+            }
+            if (p_iw->strm.avail_out == 0 && idat_flush(p_iw) != 0) {
+                return -1;
+            }
+        } while (p_iw->strm.avail_in > 0);
+        data += step;
+        len -= step;
+    }
+    return 0;
+}
+
+/**
+ * @brief: finish the deflate stream and write the last IDAT, then release
+ *         the writer (also on error)
+ * @return =0 on success, <>0 on a write or zlib error
+ */
+int idat_end(struct idat_writer *p_iw)
+{
+    int ret;
+
+    do {
+        ret = deflate(&p_iw->strm, Z_FINISH);
+        if (ret == Z_STREAM_ERROR ||
+            ((p_iw->strm.avail_out == 0 || ret == Z_STREAM_END) &&
+             idat_flush(p_iw) != 0)) {
+            ret = Z_ERRNO;
+            break;
+        }
+    } while (ret != Z_STREAM_END);
+
+    (void) deflateEnd(&p_iw->strm);
+    free(p_iw->buf);
+    p_iw->buf = NULL;
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/* read a 32 bit value stored in network (big endian) byte order */
+static U32 read_u32_be(const U8 *p)
+{
+    return ((U32) p[0] << 24) | ((U32) p[1] << 16) | ((U32) p[2] << 8) | p[3];
+}
+
+/* walks the chunks of a PNG file held in memory for png_view_parse(). The
+   current chunk is a view into that buffer, nothing is copied or
+   allocated. */
+struct chunk_iter {
+    const U8 *buf;         /* the whole file, borrowed from the caller    */
+    unsigned long size;    /* bytes in buf                                */
+    unsigned long next;    /* offset of the chunk after the current one   */
+    int skip_ancillary;    /* chunk_next() passes over ancillary chunks   */
+    const U8 *type;        /* current chunk: 4 byte type,                 */
+    const U8 *data;        /* its data                                    */
+    U32 length;            /* and data length                             */
+};
+
+/**
+ * @brief: start walking the chunks of a PNG file held in memory
+ * @param: p_it struct chunk_iter* iterator state, caller supplies
+ * @param: buf const U8* the whole file, must outlive the iterator
+ * @param: size unsigned long bytes in buf
+ * @return =0 on success, <>0 if buf does not start with the PNG signature
+ * NOTE: no chunk is current until the first chunk_next(). Ancillary
+ *       chunks are returned unless p_it->skip_ancillary is set.
+ */
+static int chunk_iter_begin(struct chunk_iter *p_it, const U8 *buf, unsigned long size)
+{
+    static const U8 sig[PNG_SIG_SIZE] = {
+        0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+    };
+
+    p_it->buf = buf;
+    p_it->size = size;
+    p_it->next = PNG_SIG_SIZE;
+    p_it->skip_ancillary = 0;
+    p_it->type = NULL;
+    p_it->data = NULL;
+    p_it->length = 0;
+    if (size < PNG_SIG_SIZE || memcmp(buf, sig, PNG_SIG_SIZE) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: move to the next chunk and check its CRC
+ * @return 1 if there is a current chunk, 0 once there are no more chunks
+ *         (IEND was the last one, anything after it is ignored), -1 if
+ *         the chunk runs past the end of the buffer or its CRC does not
+ *         match. There is no current chunk (type is NULL) after 0 or -1.
+ */
+static int chunk_next(struct chunk_iter *p_it)
+{
+    struct crc_ctx crc;
+    unsigned long pos;
+    U32 length;
+
+    for (;;) {
+        pos = p_it->next;
+        p_it->type = NULL;
+        p_it->data = NULL;
+        p_it->length = 0;
+        if (pos == p_it->size) {
+            return 0;
+        }
+        p_it->next = p_it->size; /* stop here if this chunk is bad */
+        if (p_it->size - pos < CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + CHUNK_CRC_SIZE) {
+            return -1;
+        }
+        length = read_u32_be(p_it->buf + pos);
+        if (length > p_it->size - pos - CHUNK_LEN_SIZE - CHUNK_TYPE_SIZE - CHUNK_CRC_SIZE) {
+            return -1;
+        }
+        if (p_it->skip_ancillary && CHUNK_IS_ANCILLARY(p_it->buf + pos + CHUNK_LEN_SIZE)) {
+            /* not wanted, and not worth a CRC either */
+            p_it->next = pos + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + length + CHUNK_CRC_SIZE;
+            continue;
+        }
+        crc_init(&crc);
+        crc_update(&crc, (U8 *) p_it->buf + pos + CHUNK_LEN_SIZE, CHUNK_TYPE_SIZE + length);
+        if ((U32) crc_final(&crc) != read_u32_be(p_it->buf + pos + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + length)) {
+            return -1;
+        }
+        p_it->length = length;
+        p_it->type = p_it->buf + pos + CHUNK_LEN_SIZE;
+        p_it->data = p_it->type + CHUNK_TYPE_SIZE;
+        if (memcmp(p_it->type, "IEND", CHUNK_TYPE_SIZE) != 0) {
+            p_it->next = pos + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + length + CHUNK_CRC_SIZE;
+        }
+        return 1;
+    }
+}
+
+/**
+ * @brief: is the current chunk of the given type, e.g. chunk_is(it, "IDAT")
+ */
+static int chunk_is(const struct chunk_iter *p_it, const char *type)
+{
+    return p_it->type != NULL && memcmp(p_it->type, type, CHUNK_TYPE_SIZE) == 0;
+}
+
+/**
+ * @brief: record where the chunks of a PNG file held in memory are, in
+ *         one pass, checking every CRC on the way. Nothing is allocated
+ *         or copied, the records point into buf.
+ * @param: p_pv struct png_view* filled in, caller supplies
+ * @param: buf const U8* the whole file, must outlive the view
+ * @param: size unsigned long bytes in buf
+ * @param: flags int PNG_VIEW_SKIP_ANCILLARY, PNG_VIEW_HEADER_ONLY or 0
+ * @return =0 on success: chunks[0] is IHDR and, unless only the header
+ *            was asked for, there is one run of IDATs (chunks[idat]) and
+ *            the last record is IEND;
+ *         -1 if buf does not start with the PNG signature;
+ *         -2 if a chunk is cut short, has a bad CRC or is out of place;
+ *         -3 if the critical chunks need more than PNG_MAX_VIEWS records
+ * NOTE: ancillary chunks that would leave fewer than PNG_VIEW_CRITICAL
+ *       records free are checked but not recorded, p_pv->dropped counts
+ *       them.
+ */
+int png_view_parse(struct png_view *p_pv, const U8 *buf, unsigned long size, int flags)
+{
+    struct chunk_iter it;
+    struct chunk_view *v = NULL;
+    int more;
+
+    p_pv->buf = buf;
+    p_pv->size = size;
+    p_pv->nchunks = 0;
+    p_pv->idat = -1;
+    p_pv->dropped = 0;
+    if (chunk_iter_begin(&it, buf, size) != 0) {
+        return -1;
+    }
+    it.skip_ancillary = (flags & PNG_VIEW_SKIP_ANCILLARY) != 0;
+    while ((more = chunk_next(&it)) == 1) {
+        int is_idat = chunk_is(&it, "IDAT");
+
+        if (is_idat && v != NULL && p_pv->idat == p_pv->nchunks - 1) {
+            /* the IDAT run goes on, one record covers all of it */
+            v->length += it.length;
+            v->count++;
+            v->crc = read_u32_be(it.data + it.length);
+            continue;
+        }
+        if (CHUNK_IS_ANCILLARY(it.type) &&
+            p_pv->nchunks >= PNG_MAX_VIEWS - PNG_VIEW_CRITICAL) {
+            p_pv->dropped++;
+            continue;
+        }
+        if ((is_idat && p_pv->idat >= 0) ||
+            (p_pv->nchunks == 0 &&
+             (!chunk_is(&it, "IHDR") || it.length != DATA_IHDR_SIZE))) {
+            return -2;
+        }
+        if (p_pv->nchunks == PNG_MAX_VIEWS) {
+            return -3;
+        }
+        v = &p_pv->chunks[p_pv->nchunks];
+        memcpy(v->type, it.type, CHUNK_TYPE_SIZE);
+        v->offset = it.data - buf;
+        v->length = it.length;
+        v->crc = read_u32_be(it.data + it.length);
+        v->count = 1;
+        if (is_idat) {
+            p_pv->idat = p_pv->nchunks;
+        }
+        p_pv->nchunks++;
+        if (flags & PNG_VIEW_HEADER_ONLY) {
+            return 0;
+        }
+    }
+    if (more < 0 || p_pv->idat < 0 ||
+        memcmp(v->type, "IEND", CHUNK_TYPE_SIZE) != 0) {
+        return -2;
+    }
+    return 0;
+}
+
+/* step to the next IDAT of the run starting at *p_pos (the offset of the
+   current chunk's data), passing over ancillary chunks that the view left
+   out; the run was checked by png_view_parse() */
+static const U8 *view_next_idat(const struct png_view *p_pv, unsigned long *p_pos, U32 *p_len)
+{
+    const U8 *p = p_pv->buf + *p_pos;
+
+    for (;;) {
+        U32 len = read_u32_be(p - CHUNK_TYPE_SIZE - CHUNK_LEN_SIZE);
+
+        if (memcmp(p - CHUNK_TYPE_SIZE, "IDAT", CHUNK_TYPE_SIZE) == 0) {
+            *p_len = len;
+            *p_pos = (p - p_pv->buf) + len + CHUNK_CRC_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+            return p;
+        }
+        p += len + CHUNK_CRC_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+    }
+}
+
+/**
+ * @brief: copy the zlib stream split over the IDAT run into one buffer
+ * @param: dest U8* p_pv->chunks[p_pv->idat].length bytes
+ */
+void png_view_copy_idat(const struct png_view *p_pv, U8 *dest)
+{
+    const struct chunk_view *v = &p_pv->chunks[p_pv->idat];
+    unsigned long pos = v->offset;
+    U32 i, len;
+
+    for (i = 0; i < v->count; i++) {
+        const U8 *data = view_next_idat(p_pv, &pos, &len);
+
+        memcpy(dest, data, len);
+        dest += len;
+    }
+}
+
+/**
+ * @brief: inflate the image data of the IDAT run, feeding each chunk's
+ *         payload to one inflate stream where it lies in the buffer
+ * @param: p_pv const struct png_view* from png_view_parse()
+ * @param: dest U8* output, exactly dest_len bytes of scanlines expected
+ *         (png_stride() times the height)
+ * @param: dest_len unsigned long size of dest
+ * @return =0 on success, <>0 on bad zlib data or a length other than dest_len
+ */
+int png_view_inflate_idat(const struct png_view *p_pv, U8 *dest, unsigned long dest_len)
+{
+    const struct chunk_view *v = &p_pv->chunks[p_pv->idat];
+    unsigned long pos = v->offset;
+    z_stream strm;
+    int ret = Z_OK;
+    U32 i, len;
+    int err;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+        return -1;
+    }
+    strm.next_out = dest;
+    for (i = 0; i < v->count && ret == Z_OK; i++) {
+        strm.next_in = (U8 *) view_next_idat(p_pv, &pos, &len);
+        strm.avail_in = len;
+        while (strm.avail_in > 0 && ret == Z_OK) {
+            /* avail_out is 32 bits wide, hand dest over in steps */
+            unsigned long left = dest_len - (strm.next_out - dest);
+            strm.avail_out = left > 0x40000000UL ? 0x40000000U : (uInt) left;
+            ret = inflate(&strm, Z_NO_FLUSH);
+        }
+    }
+    /* a full dest with input left over gives Z_BUF_ERROR, too much data */
+    err = (ret != Z_STREAM_END ||
+           (unsigned long) (strm.next_out - dest) != dest_len);
+    (void) inflateEnd(&strm);
+    return err ? -1 : 0;
+}
+
+/**
+ * @brief: read nothing but the signature and IHDR of a PNG file, the 33
+ *         bytes at its start, for checking inputs before the real work
+ * @param: path const char* the file
+ * @param: p_ihdr struct data_IHDR* filled in, width and height in host
+ *         byte order
+ * @param: p_size unsigned long* output, the file size (for sizing buffers)
+ * @return =0 on success, -1 if the file can't be opened or read, -2 if it
+ *         is not a PNG file, -3 if the IHDR is missing or its CRC is bad
+ */
+int png_read_header(const char *path, struct data_IHDR *p_ihdr, unsigned long *p_size)
+{
+    U8 head[PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + DATA_IHDR_SIZE + CHUNK_CRC_SIZE];
+    struct png_view pv;
+    struct stat st;
+    ssize_t n;
+    const U8 *d;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, head, sizeof(head));
+    if (n < 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    *p_size = st.st_size;
+    switch (png_view_parse(&pv, head, n, PNG_VIEW_HEADER_ONLY)) {
+    case 0:
+        break;
+    case -1:
+        return -2;
+    default:
+        return -3;
+    }
+    d = head + pv.chunks[0].offset;
+    p_ihdr->width = read_u32_be(d);
+    p_ihdr->height = read_u32_be(d + 4);
+    p_ihdr->bit_depth = d[8];
+    p_ihdr->color_type = d[9];
+    p_ihdr->compression = d[10];
+    p_ihdr->filter = d[11];
+    p_ihdr->interlace = d[12];
+    return 0;
+}
+
+/**
+ * @brief: make a whole input file readable in memory, for png_view_parse()
+ * @param: p_map struct png_map* filled in on success
+ * @param: path const char* the file
+ * @return =0 on success, <>0 if the file can't be opened, mapped or read
+ * NOTE: regular files are mapped read-only and the kernel is told they
+ *       will be read once, front to back, so it reads ahead and drops the
+ *       pages behind; the chunks are then parsed and inflated straight
+ *       from the page cache. Anything that can't be mapped (a pipe, an
+ *       empty file) is read into a malloc'd buffer instead.
+ */
+int png_map_file(struct png_map *p_map, const char *path)
+{
+    struct stat st;
+    unsigned long cap = 0;
+    int fd = open(path, O_RDONLY);
+
+    p_map->buf = NULL;
+    p_map->size = 0;
+    p_map->mapped = 0;
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (p != MAP_FAILED) {
+            (void) posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+            (void) posix_madvise(p, st.st_size, POSIX_MADV_WILLNEED);
+            p_map->buf = p;
+            p_map->size = st.st_size;
+            p_map->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+    for (;;) {
+        ssize_t n;
+
+        if (p_map->size == cap) {
+            U8 *p = realloc(p_map->buf, cap ? 2 * cap : 64 * 1024);
+
+            if (p == NULL) {
+                break;
+            }
+            p_map->buf = p;
+            cap = cap ? 2 * cap : 64 * 1024;
+        }
+        n = read(fd, p_map->buf + p_map->size, cap - p_map->size);
+        if (n <= 0) {
+            close(fd);
+            if (n == 0) {
+                return 0;
+            }
+            break;
+        }
+        p_map->size += n;
+    }
+    close(fd);
+    free(p_map->buf);
+    p_map->buf = NULL;
+    p_map->size = 0;
+    return -1;
+}
+
+/**
+ * @brief: release what png_map_file() set up
+ */
+void png_unmap(struct png_map *p_map)
+{
+    if (p_map->mapped) {
+        (void) munmap(p_map->buf, p_map->size);
+    } else {
+        free(p_map->buf);
+    }
+    p_map->buf = NULL;
+    p_map->size = 0;
+    p_map->mapped = 0;
+}
@@ -8,6 +8,10 @@
  * INCLUDE HEADER FILES
  *****************************************************************************/
 #include <stdio.h>
+#include <sys/uio.h> /* for struct iovec   */
+#include "crc.h"     /* for struct crc_ctx */
+#include "zlib.h"    /* for z_stream       */
+#include "arena.h"   /* for struct arena   */
 
 /******************************************************************************
  * DEFINED MACROS 
@@ -19,6 +23,34 @@
 #define CHUNK_CRC_SIZE  4 /* chunk CRC field size in bytes */
 #define DATA_IHDR_SIZE 13 /* IHDR chunk data field size */
 
+/* bit 5 of a chunk type's first letter (lower case) marks ancillary chunks */
+#define CHUNK_IS_ANCILLARY(type) (((type)[0] & 0x20) != 0)
+
+#define IDAT_CHUNK_SIZE (256 * 1024) /* data bytes per IDAT from idat_writer */
+
+#define PNG_MAX_VIEWS 64 /* chunk records in a struct png_view */
+#define PNG_VIEW_CRITICAL 3 /* records ancillary chunks can't take, so
+                               PLTE, the IDAT run and IEND still fit */
+
+#define PNG_OUT_SEGS 64  /* segments a png_out queues before writing    */
+#define PNG_OUT_GLUE 16  /* bytes of CRC, length and type between two
+                            chunks' data, stored as one segment        */
+
+/* raw pixel files, see png_out_raw_header(): a fixed header, then the rows */
+#define RAW_SIG_SIZE     8 /* bytes of raw file signature                */
+#define RAW_HEADER_SIZE 32 /* header bytes, the first row starts here   */
+
+/* png_view_parse() flags */
+#define PNG_VIEW_SKIP_ANCILLARY 1 /* leave ancillary chunks out            */
+#define PNG_VIEW_HEADER_ONLY    2 /* stop after IHDR, the rest isn't read  */
+
+/* scanline filter types, the first byte of every row of image data */
+#define PNG_FILTER_NONE  0
+#define PNG_FILTER_SUB   1
+#define PNG_FILTER_UP    2
+#define PNG_FILTER_AVG   3
+#define PNG_FILTER_PAETH 4
+
 /******************************************************************************
  * STRUCTURES and TYPEDEFS 
  *****************************************************************************/
@@ -55,8 +87,84 @@ typedef struct simple_PNG {
     struct chunk *p_IEND;
 } *simple_PNG_p;
 
+/* writes a PNG file as a list of segments: the chunks' data, borrowed
+   from the caller, and between them the signature, length, type and CRC
+   fields, laid out in a small arena. png_out_flush() hands the whole
+   list to the kernel with one pwritev(). */
+typedef struct png_out {
+    int fd;                /* output file                                 */
+    unsigned long offset;  /* file offset the queued segments go to       */
+    unsigned long queued;  /* bytes queued and not written yet            */
+    int nthreads;          /* threads for the CRC of large chunks, see
+                              crc_parallel(); png_out_open() sets 1       */
+    int nsegs;             /* segments queued                             */
+    U8 *glue;              /* last segment if it is fields that more
+                              fields can go onto the end of, else NULL    */
+    struct arena fields;   /* where the fields are laid out               */
+    struct iovec segs[PNG_OUT_SEGS];
+} *png_out_p;
+
+/* where one chunk is in a file held in memory. A run of consecutive
+   IDATs is one record: offset is the first one's data, length the total
+   of all of them. */
+typedef struct chunk_view {
+    U8 type[CHUNK_TYPE_SIZE];
+    U32 length;            /* data length, in host byte order             */
+    U32 crc;               /* stored CRC (already checked), for an IDAT
+                              run that of the last IDAT                   */
+    U32 count;             /* chunks in the record, >1 only for IDATs     */
+    unsigned long offset;  /* of the data, from the start of the file     */
+} *chunk_view_p;
+
+/* all the chunks of a PNG file held in memory, from png_view_parse() */
+typedef struct png_view {
+    const U8 *buf;         /* the whole file, borrowed from the caller    */
+    unsigned long size;    /* bytes in buf                                */
+    int nchunks;           /* records used                                */
+    int idat;              /* index of the IDAT run, -1 if none           */
+    int dropped;           /* ancillary chunks left out for want of room  */
+    struct chunk_view chunks[PNG_MAX_VIEWS];
+} *png_view_p;
+
+/* a whole input file in memory, from png_map_file() */
+typedef struct png_map {
+    U8 *buf;               /* file contents, read only                    */
+    unsigned long size;    /* file size in bytes                          */
+    int mapped;            /* 1 if buf is an mmap()ed region, 0 if malloc */
+} *png_map_p;
+
+/* deflates image data as it arrives and writes it out as a run of IDAT
+   chunks of IDAT_CHUNK_SIZE bytes (the last one shorter), so neither the
+   image nor its compressed form is ever held in memory as a whole */
+typedef struct idat_writer {
+    struct png_out *out;   /* output file                                 */
+    z_stream strm;         /* one deflate stream across all the chunks    */
+    U8 *buf;               /* deflated data for the IDAT being filled     */
+    U32 nchunks;           /* IDAT chunks written so far                  */
+} *idat_writer_p;
+
 /******************************************************************************
  * FUNCTION PROTOTYPES 
  *****************************************************************************/
 
 /* declare your own functions prototypes here */
+int png_out_open(struct png_out *p_po, const char *path);
+int png_out_sig(struct png_out *p_po);
+int png_out_chunk(struct png_out *p_po, const U8 *type, const U8 *data, U32 length);
+int png_out_raw_header(struct png_out *p_po, const struct data_IHDR *p_ihdr,
+                       U32 plte_len);
+int png_out_data(struct png_out *p_po, const U8 *data, unsigned long len);
+int png_out_flush(struct png_out *p_po);
+int png_out_close(struct png_out *p_po);
+U32 png_bpp(const struct data_IHDR *p_ihdr);
+unsigned long png_stride(const struct data_IHDR *p_ihdr);
+int png_detach_first_row(U8 *rows, const struct data_IHDR *p_ihdr);
+int idat_begin(struct idat_writer *p_iw, struct png_out *out, int level);
+int idat_write(struct idat_writer *p_iw, const U8 *data, unsigned long len);
+int idat_end(struct idat_writer *p_iw);
+int png_view_parse(struct png_view *p_pv, const U8 *buf, unsigned long size, int flags);
+void png_view_copy_idat(const struct png_view *p_pv, U8 *dest);
+int png_view_inflate_idat(const struct png_view *p_pv, U8 *dest, unsigned long dest_len);
+int png_read_header(const char *path, struct data_IHDR *p_ihdr, unsigned long *p_size);
+int png_map_file(struct png_map *p_map, const char *path);
+void png_unmap(struct png_map *p_map);
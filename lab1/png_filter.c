@@ -0,0 +1,802 @@
+/**
+ * @brief: undo the PNG scanline filters (None, Sub, Up, Average, Paeth)
+ *         and choose new ones, see https://www.w3.org/TR/PNG-Filters.html
+ * NOTES: every kernel works on the pixel bytes of one row (the filter
+ *        byte already taken off) with the unfiltered row above it.
+ *        Sub, Average and Paeth depend on the pixel to the left once it
+ *        is unfiltered, so only Up is SIMD across the row. The others
+ *        are SIMD across one pixel's bytes, or for Sub a prefix sum over
+ *        as many whole pixels as fit in 16 bytes. The kernels are made
+ *        per bpp with macros so that every shift count is a constant,
+ *        as the SSE2 byte shifts require.
+ */
+
+#define _POSIX_C_SOURCE 200112L /* for sysconf() */
+
+#include <stdlib.h>   /* for malloc(), free() */
+#include <string.h>   /* for memcpy()         */
+#include <pthread.h>  /* for pthread_create(), pthread_join() */
+#include <unistd.h>   /* for sysconf()        */
+#include "png_filter.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define PNG_FILTER_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* bytes of a pixel row that an unfilter kernel works on */
+typedef void (*row_kernel)(U8 *row, const U8 *prev, unsigned long len);
+
+/******************************************************************************
+ * SCALAR REFERENCE
+ *****************************************************************************/
+
+/* the Paeth predictor: whichever of a (left), b (above) and c (above
+   left) is closest to a + b - c, ties going to a, then b */
+static U8 paeth(int a, int b, int c)
+{
+    int pa = b - c;
+    int pb = a - c;
+    int pc = pa + pb;
+
+    pa = pa < 0 ? -pa : pa;
+    pb = pb < 0 ? -pb : pb;
+    pc = pc < 0 ? -pc : pc;
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+/* undo one filter on len pixel bytes, prev is the row above */
+static void unfilter_scalar(U8 *row, const U8 *prev, unsigned long len,
+                            U32 bpp, U8 filter)
+{
+    unsigned long i;
+
+    switch (filter) {
+    case PNG_FILTER_SUB:
+        for (i = bpp; i < len; i++) {
+            row[i] += row[i - bpp];
+        }
+        break;
+    case PNG_FILTER_UP:
+        for (i = 0; i < len; i++) {
+            row[i] += prev[i];
+        }
+        break;
+    case PNG_FILTER_AVG:
+        for (i = 0; i < bpp && i < len; i++) {
+            row[i] += prev[i] >> 1;
+        }
+        for (; i < len; i++) {
+            row[i] += (row[i - bpp] + prev[i]) >> 1;
+        }
+        break;
+    case PNG_FILTER_PAETH:
+        for (i = 0; i < bpp && i < len; i++) {
+            row[i] += prev[i];            /* a = c = 0 */
+        }
+        for (; i < len; i++) {
+            row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        }
+        break;
+    }
+}
+
+#ifdef PNG_FILTER_SIMD
+/******************************************************************************
+ * SSE2 KERNELS
+ *****************************************************************************/
+
+/* the n bytes of one pixel in the low bytes of a register, n <= 8; the
+   copy stops at the pixel so the last one of a buffer is safe to load */
+static inline __m128i load_px(const U8 *p, int n)
+{
+    unsigned long long v = 0;
+
+    memcpy(&v, p, n);
+    return _mm_loadl_epi64((const __m128i *) &v);
+}
+
+static inline void store_px(U8 *p, __m128i x, int n)
+{
+    unsigned long long v;
+
+    _mm_storel_epi64((__m128i *) &v, x);
+    memcpy(p, &v, n);
+}
+
+/* the Paeth predictor for 8 bytes in 16 bit lanes, so that the
+   distances can't overflow; the choice is made branch free with masks */
+static inline __m128i paeth16(__m128i a, __m128i b, __m128i c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    __m128i use_a, use_b, pred;
+
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    use_a = _mm_and_si128(_mm_cmpgt_epi16(_mm_add_epi16(pb, one), pa),
+                          _mm_cmpgt_epi16(_mm_add_epi16(pc, one), pa));
+    use_b = _mm_cmpgt_epi16(_mm_add_epi16(pc, one), pb);
+    pred = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, pred));
+}
+
+static void up_sse2(U8 *row, const U8 *prev, unsigned long len)
+{
+    unsigned long i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+        _mm_storeu_si128((__m128i *) (row + i), _mm_add_epi8(x, b));
+    }
+    for (; i < len; i++) {
+        row[i] += prev[i];
+    }
+}
+
+/* Sub: a block of K = (16 / N) * N bytes at a time. The left neighbour
+   of the block's first pixel is added to it, then a log-step prefix sum
+   (shifts of N, 2N, 4N, 8N bytes) adds every pixel to the ones after it.
+   Bytes past K belong to the next block and are put back untouched.
+   With K < 16 the next block overlaps this one's store, so it is loaded
+   before the store: loading it after would stall on store forwarding. */
+#define SUB_SSE2(N)                                                         \
+static void sub_sse2_##N(U8 *row, const U8 *prev, unsigned long len)        \
+{                                                                           \
+    enum { K = (16 / N) * N };                                              \
+    const __m128i keep = _mm_srli_si128(_mm_set1_epi8(-1), 16 - K);         \
+    __m128i carry = _mm_setzero_si128();                                    \
+    unsigned long i = 0;                                                    \
+                                                                            \
+    __m128i in = _mm_setzero_si128();                                       \
+                                                                            \
+    (void) prev;                                                            \
+    if (len >= 16) {                                                        \
+        in = _mm_loadu_si128((const __m128i *) row);                        \
+    }                                                                       \
+    for (; i + 16 <= len; i += K) {                                         \
+        __m128i x = _mm_add_epi8(in, carry);                                \
+        __m128i next = in;                                                  \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, N));                          \
+        if (2 * N < K) {                                                    \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * N));                  \
+        }                                                                   \
+        if (4 * N < K) {                                                    \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * N));                  \
+        }                                                                   \
+        if (8 * N < K) {                                                    \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * N));                  \
+        }                                                                   \
+        if (K < 16) {                                                       \
+            x = _mm_or_si128(_mm_and_si128(keep, x),                        \
+                             _mm_andnot_si128(keep, in));                   \
+        }                                                                   \
+        if (i + K + 16 <= len) {                                            \
+            next = _mm_loadu_si128((const __m128i *) (row + i + K));        \
+        }                                                                   \
+        _mm_storeu_si128((__m128i *) (row + i), x);                         \
+        carry = _mm_srli_si128(_mm_slli_si128(x, 16 - K), 16 - N);          \
+        in = next;                                                          \
+    }                                                                       \
+    for (i = i > N ? i : N; i < len; i++) {                                 \
+        row[i] += row[i - N];                                               \
+    }                                                                       \
+}
+
+/* the low n bytes of x with the rest of the 8 from keep, so that an 8
+   byte store of a pixel puts the bytes after it back as they were */
+static inline __m128i merge_px(__m128i x, __m128i keep, int n)
+{
+    const __m128i mask = _mm_srli_epi64(_mm_set1_epi8(-1), 64 - 8 * n);
+
+    return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, keep));
+}
+
+/* Average, one pixel at a time: _mm_avg_epu8 rounds up, the filter
+   rounds down, so the carry bit of a ^ b is taken back off. 4 and 8
+   byte pixels are moved as they are; 6 byte ones (3 byte ones for
+   Paeth) with 8 byte loads and stores while the row has room for them,
+   each pixel loaded before the one before it is stored: a load that
+   overlaps an earlier, wider store would stall on store forwarding. */
+#define AVG_SSE2(N)                                                         \
+static void avg_sse2_##N(U8 *row, const U8 *prev, unsigned long len)        \
+{                                                                           \
+    const __m128i one = _mm_set1_epi8(1);                                   \
+    __m128i a = _mm_setzero_si128();                                        \
+    unsigned long i = 0;                                                    \
+                                                                            \
+    __m128i x = _mm_setzero_si128();                                        \
+                                                                            \
+    if (N % 4 != 0 && len >= 8) {                                           \
+        x = _mm_loadl_epi64((const __m128i *) row);                         \
+    }                                                                       \
+    for (; N % 4 != 0 && i + 8 <= len; i += N) {                            \
+        __m128i b = _mm_loadl_epi64((const __m128i *) (prev + i));          \
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),                      \
+                          _mm_and_si128(_mm_xor_si128(a, b), one));         \
+        __m128i next = x;                                                   \
+                                                                            \
+        a = _mm_add_epi8(x, avg);                                           \
+        if (i + N + 8 <= len) {                                             \
+            next = _mm_loadl_epi64((const __m128i *) (row + i + N));        \
+        }                                                                   \
+        _mm_storel_epi64((__m128i *) (row + i), merge_px(a, x, N));         \
+        x = next;                                                           \
+    }                                                                       \
+    for (; i + N <= len; i += N) {                                          \
+        __m128i b = load_px(prev + i, N);                                   \
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),                      \
+                          _mm_and_si128(_mm_xor_si128(a, b), one));         \
+        a = _mm_add_epi8(load_px(row + i, N), avg);                         \
+        store_px(row + i, a, N);                                            \
+    }                                                                       \
+}
+
+/* Paeth, one pixel at a time, moved as for Average */
+#define PAETH_SSE2(N)                                                       \
+static void paeth_sse2_##N(U8 *row, const U8 *prev, unsigned long len)      \
+{                                                                           \
+    const __m128i zero = _mm_setzero_si128();                               \
+    __m128i a = zero;                                                       \
+    __m128i c = zero;                                                       \
+    unsigned long i = 0;                                                    \
+                                                                            \
+    __m128i raw = zero;                                                     \
+                                                                            \
+    if (N % 4 != 0 && len >= 8) {                                           \
+        raw = _mm_loadl_epi64((const __m128i *) row);                       \
+    }                                                                       \
+    for (; N % 4 != 0 && i + 8 <= len; i += N) {                            \
+        __m128i b = _mm_unpacklo_epi8(                                      \
+            _mm_loadl_epi64((const __m128i *) (prev + i)), zero);           \
+        __m128i x = _mm_unpacklo_epi8(raw, zero);                           \
+        __m128i next = raw;                                                 \
+                                                                            \
+        a = _mm_and_si128(_mm_add_epi16(x, paeth16(a, b, c)),               \
+                          _mm_set1_epi16(0xff));                            \
+        c = b;                                                              \
+        if (i + N + 8 <= len) {                                             \
+            next = _mm_loadl_epi64((const __m128i *) (row + i + N));        \
+        }                                                                   \
+        _mm_storel_epi64((__m128i *) (row + i),                             \
+                         merge_px(_mm_packus_epi16(a, zero), raw, N));      \
+        raw = next;                                                         \
+    }                                                                       \
+    for (; i + N <= len; i += N) {                                          \
+        __m128i b = _mm_unpacklo_epi8(load_px(prev + i, N), zero);          \
+        __m128i x = _mm_unpacklo_epi8(load_px(row + i, N), zero);           \
+        a = _mm_and_si128(_mm_add_epi16(x, paeth16(a, b, c)),               \
+                          _mm_set1_epi16(0xff));                            \
+        c = b;                                                              \
+        store_px(row + i, _mm_packus_epi16(a, zero), N);                    \
+    }                                                                       \
+}
+
+/* 1 and 2 byte pixels gain nothing from a register per pixel, nor do
+   3 byte ones for Average; the scalar loops with the distance a
+   constant do better */
+#define AVG_FIXED(N)                                                        \
+static void avg_fixed_##N(U8 *row, const U8 *prev, unsigned long len)       \
+{                                                                           \
+    unsigned long i;                                                        \
+                                                                            \
+    for (i = 0; i < N && i < len; i++) {                                    \
+        row[i] += prev[i] >> 1;                                             \
+    }                                                                       \
+    for (; i < len; i++) {                                                  \
+        row[i] += (row[i - N] + prev[i]) >> 1;                              \
+    }                                                                       \
+}
+
+#define PAETH_FIXED(N)                                                      \
+static void paeth_fixed_##N(U8 *row, const U8 *prev, unsigned long len)     \
+{                                                                           \
+    unsigned long i;                                                        \
+                                                                            \
+    for (i = 0; i < N && i < len; i++) {                                    \
+        row[i] += prev[i];                                                  \
+    }                                                                       \
+    for (; i < len; i++) {                                                  \
+        row[i] += paeth(row[i - N], prev[i], prev[i - N]);                  \
+    }                                                                       \
+}
+
+SUB_SSE2(1)
+SUB_SSE2(2)
+SUB_SSE2(3)
+SUB_SSE2(4)
+SUB_SSE2(6)
+SUB_SSE2(8)
+AVG_FIXED(1)
+AVG_FIXED(2)
+AVG_FIXED(3)
+AVG_SSE2(4)
+AVG_SSE2(6)
+AVG_SSE2(8)
+PAETH_FIXED(1)
+PAETH_FIXED(2)
+PAETH_SSE2(3)
+PAETH_SSE2(4)
+PAETH_SSE2(6)
+PAETH_SSE2(8)
+
+/* indexed by bpp; 5 and 7 byte pixels don't exist */
+static const row_kernel sub_sse2[9] = {
+    NULL, sub_sse2_1, sub_sse2_2, sub_sse2_3, sub_sse2_4,
+    NULL, sub_sse2_6, NULL, sub_sse2_8
+};
+static const row_kernel avg_sse2[9] = {
+    NULL, avg_fixed_1, avg_fixed_2, avg_fixed_3, avg_sse2_4,
+    NULL, avg_sse2_6, NULL, avg_sse2_8
+};
+static const row_kernel paeth_sse2[9] = {
+    NULL, paeth_fixed_1, paeth_fixed_2, paeth_sse2_3, paeth_sse2_4,
+    NULL, paeth_sse2_6, NULL, paeth_sse2_8
+};
+
+/******************************************************************************
+ * AVX2 KERNELS
+ * Built for AVX2 whatever the compiler flags, and only called when the
+ * CPU has it.
+ *****************************************************************************/
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void up_avx2(U8 *row, const U8 *prev, unsigned long len)
+{
+    unsigned long i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (prev + i));
+        _mm256_storeu_si256((__m256i *) (row + i), _mm256_add_epi8(x, b));
+    }
+    for (; i < len; i++) {
+        row[i] += prev[i];
+    }
+}
+
+#pragma GCC pop_options
+#endif /* PNG_FILTER_SIMD */
+
+/**
+ * @brief: the fastest kernel set this CPU can run
+ * @return PNG_KERNEL_AVX2, PNG_KERNEL_SSE2 or PNG_KERNEL_SCALAR
+ */
+int png_kernel_best(void)
+{
+#ifdef PNG_FILTER_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? PNG_KERNEL_AVX2 : PNG_KERNEL_SSE2;
+#else
+    return PNG_KERNEL_SCALAR;
+#endif
+}
+
+/* undo the filter of one row; prev is NULL for the first row of an
+   image, whose row above is all zeros */
+static int unfilter_row(U8 *row, const U8 *prev, unsigned long len,
+                        U32 bpp, U8 filter, int kernel)
+{
+    unsigned long i;
+
+    if (filter > PNG_FILTER_PAETH) {
+        return -1;
+    }
+    if (prev == NULL) {
+        /* against zeros Up is None and Paeth is Sub */
+        if (filter == PNG_FILTER_UP || filter == PNG_FILTER_NONE) {
+            return 0;
+        }
+        if (filter == PNG_FILTER_AVG) {
+            for (i = bpp; i < len; i++) {
+                row[i] += row[i - bpp] >> 1;
+            }
+            return 0;
+        }
+        filter = PNG_FILTER_SUB;
+    }
+    if (filter == PNG_FILTER_NONE) {
+        return 0;
+    }
+#ifdef PNG_FILTER_SIMD
+    if (kernel >= PNG_KERNEL_SSE2) {
+        switch (filter) {
+        case PNG_FILTER_SUB:
+            sub_sse2[bpp](row, prev, len);
+            break;
+        case PNG_FILTER_UP:
+            (kernel >= PNG_KERNEL_AVX2 ? up_avx2 : up_sse2)(row, prev, len);
+            break;
+        case PNG_FILTER_AVG:
+            avg_sse2[bpp](row, prev, len);
+            break;
+        case PNG_FILTER_PAETH:
+            paeth_sse2[bpp](row, prev, len);
+            break;
+        }
+        return 0;
+    }
+#endif
+    unfilter_scalar(row, prev, len, bpp, filter);
+    return 0;
+}
+
+/**
+ * @brief: undo the filters of inflated image data in place, with the
+ *         fastest kernels this CPU can run
+ * @param: rows U8* height scanlines of png_stride() bytes, filter first
+ * @param: height unsigned long rows in rows
+ * @param: p_ihdr const struct data_IHDR* the image's IHDR
+ * @return =0 on success, every filter byte is then PNG_FILTER_NONE and
+ *         the rest are the image's samples
+ *         <>0 on a bad color type or filter type, rows is then partly
+ *         unfiltered
+ */
+int png_unfilter(U8 *rows, unsigned long height, const struct data_IHDR *p_ihdr)
+{
+    return png_unfilter_with(rows, height, p_ihdr, png_kernel_best());
+}
+
+/**
+ * @brief: png_unfilter() with the kernel set given, for comparing them;
+ *         a set this CPU can't run falls back to the best it can
+ * @param: kernel int PNG_KERNEL_SCALAR, PNG_KERNEL_SSE2 or PNG_KERNEL_AVX2
+ */
+int png_unfilter_with(U8 *rows, unsigned long height,
+                      const struct data_IHDR *p_ihdr, int kernel)
+{
+    U32 bpp = png_bpp(p_ihdr);
+    unsigned long stride = png_stride(p_ihdr);
+    const U8 *prev = NULL;
+    unsigned long r;
+
+    if (stride == 0) {
+        return -1;
+    }
+    if (kernel > PNG_KERNEL_SCALAR) {
+        int best = png_kernel_best();
+        kernel = kernel < best ? kernel : best;
+    }
+    for (r = 0; r < height; r++) {
+        U8 *row = rows + r * stride;
+
+        if (unfilter_row(row + 1, prev, stride - 1, bpp, row[0], kernel) != 0) {
+            return -1;
+        }
+        row[0] = PNG_FILTER_NONE;
+        prev = row + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief: drop the filter type byte of every unfiltered row, moving the
+ *         samples down so that the rows follow one another with no gaps
+ * @param: rows U8* height scanlines of png_stride() bytes, unfiltered
+ * @param: height unsigned long rows in rows
+ * @param: p_ihdr const struct data_IHDR* the image's IHDR
+ * @return bytes of samples now at the start of rows, 0 on a bad color
+ *         type
+ * NOTE: each row only moves down by its row number, so one memmove() per
+ *       row does it in place.
+ */
+unsigned long png_pack_rows(U8 *rows, unsigned long height,
+                            const struct data_IHDR *p_ihdr)
+{
+    unsigned long stride = png_stride(p_ihdr);
+    unsigned long r;
+
+    if (stride == 0) {
+        return 0;
+    }
+    for (r = 0; r < height; r++) {
+        memmove(rows + r * (stride - 1), rows + r * stride + 1, stride - 1);
+    }
+    return height * (stride - 1);
+}
+
+/******************************************************************************
+ * RE-FILTERING
+ * Every row of unfiltered image data is filtered all five ways and the
+ * one whose bytes, taken as signed, have the smallest sum of absolute
+ * values is kept: the minimum sum of absolute differences heuristic,
+ * as libpng uses. Filtering only reads unfiltered rows, so unlike
+ * unfiltering it is SIMD across the whole row for every filter type.
+ *****************************************************************************/
+
+/* one filtered byte, a, b and c as for paeth() */
+static U8 filter_byte(U8 filter, U8 x, U8 a, U8 b, U8 c)
+{
+    switch (filter) {
+    case PNG_FILTER_SUB:
+        return x - a;
+    case PNG_FILTER_UP:
+        return x - b;
+    case PNG_FILTER_AVG:
+        return x - ((a + b) >> 1);
+    case PNG_FILTER_PAETH:
+        return x - paeth(a, b, c);
+    default:
+        return x;
+    }
+}
+
+/* filter bytes [from, to) of row into out, return the sum of their
+   absolute values taken as signed */
+static unsigned long filter_scalar(U8 *out, const U8 *row, const U8 *prev,
+                                   U32 bpp, U8 filter,
+                                   unsigned long from, unsigned long to)
+{
+    unsigned long sum = 0;
+    unsigned long i;
+
+    for (i = from; i < to; i++) {
+        U8 a = i >= bpp ? row[i - bpp] : 0;
+        U8 c = i >= bpp ? prev[i - bpp] : 0;
+
+        out[i] = filter_byte(filter, row[i], a, prev[i], c);
+        sum += out[i] < 128 ? out[i] : 256 - out[i];
+    }
+    return sum;
+}
+
+#ifdef PNG_FILTER_SIMD
+/* filter_scalar() over a whole row, 16 bytes at a time after the first
+   pixel. |x| of a signed byte is the smaller of x and -x unsigned, and
+   _mm_sad_epu8 adds them up. */
+static unsigned long filter_sse2(U8 *out, const U8 *row, const U8 *prev,
+                                 unsigned long len, U32 bpp, U8 filter)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i acc = zero;
+    unsigned long long lanes[2];
+    unsigned long i = bpp < len ? bpp : len;
+    unsigned long sum = filter_scalar(out, row, prev, bpp, filter, 0, i);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+        __m128i a = _mm_loadu_si128((const __m128i *) (row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+        __m128i c, pred;
+
+        switch (filter) {
+        case PNG_FILTER_SUB:
+            x = _mm_sub_epi8(x, a);
+            break;
+        case PNG_FILTER_UP:
+            x = _mm_sub_epi8(x, b);
+            break;
+        case PNG_FILTER_AVG:
+            pred = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                                _mm_and_si128(_mm_xor_si128(a, b), one));
+            x = _mm_sub_epi8(x, pred);
+            break;
+        case PNG_FILTER_PAETH:
+            c = _mm_loadu_si128((const __m128i *) (prev + i - bpp));
+            pred = _mm_packus_epi16(
+                paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                        _mm_unpacklo_epi8(c, zero)),
+                paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                        _mm_unpackhi_epi8(c, zero)));
+            x = _mm_sub_epi8(x, pred);
+            break;
+        }
+        _mm_storeu_si128((__m128i *) (out + i), x);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+    }
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    sum += lanes[0] + lanes[1];
+    return sum + filter_scalar(out, row, prev, bpp, filter, i, len);
+}
+#endif /* PNG_FILTER_SIMD */
+
+/* one block of rows for the png_refilter() threads */
+struct refilter_block {
+    U8 *rows;              /* its first row, filter byte first            */
+    unsigned long nrows;   /* rows in the block                           */
+    const U8 *above;       /* unfiltered pixels of the row above it,
+                              zeros for the image's first row             */
+    const struct data_IHDR *p_ihdr;
+    int kernel;            /* PNG_KERNEL_*                                */
+    int keep_none;         /* filter every row with None                  */
+    int ret;               /* 0 or what went wrong                        */
+};
+
+/* thread body of the first pass: each block starts at a row filtered
+   with None or Sub, which doesn't use the row above it */
+static void *unfilter_block(void *arg)
+{
+    struct refilter_block *blk = arg;
+
+    blk->ret = png_unfilter_with(blk->rows, blk->nrows, blk->p_ihdr, blk->kernel);
+    return NULL;
+}
+
+/* thread body of the second pass: filter the block's rows bottom up,
+   in place, so the row above each one is still unfiltered when it is
+   read; the block's first row reads the copy in blk->above */
+static void *filter_block(void *arg)
+{
+    struct refilter_block *blk = arg;
+    U32 bpp = png_bpp(blk->p_ihdr);
+    unsigned long stride = png_stride(blk->p_ihdr);
+    unsigned long len = stride - 1;
+    U8 *cand = malloc(2 * (len > 0 ? len : 1));
+    U8 *best = cand + len;
+    unsigned long r;
+
+    blk->ret = 0;
+    if (blk->keep_none) {
+        free(cand);
+        return NULL;       /* png_unfilter() left every row None */
+    }
+    if (cand == NULL) {
+        blk->ret = -1;
+        return NULL;
+    }
+    for (r = blk->nrows; r-- > 0; ) {
+        U8 *row = blk->rows + r * stride;
+        const U8 *prev = (r == 0) ? blk->above : row - stride + 1;
+        unsigned long min = (unsigned long) -1;
+        U8 filter, choice = PNG_FILTER_NONE;
+
+        for (filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+            unsigned long sum;
+#ifdef PNG_FILTER_SIMD
+            if (blk->kernel >= PNG_KERNEL_SSE2) {
+                sum = filter_sse2(cand, row + 1, prev, len, bpp, filter);
+            } else
+#endif
+            sum = filter_scalar(cand, row + 1, prev, bpp, filter, 0, len);
+            if (sum < min) {
+                U8 *t = best;
+                best = cand;
+                cand = t;
+                min = sum;
+                choice = filter;
+            }
+        }
+        row[0] = choice;
+        memcpy(row + 1, best, len);
+    }
+    free(cand < best ? cand : best);
+    return NULL;
+}
+
+/* run one pass over the blocks, block 0 on the calling thread; a block
+   whose thread can't be started is done here too */
+static int refilter_pass(struct refilter_block *blk, int nblocks, void *(*body)(void *))
+{
+    pthread_t tid[PNG_REFILTER_MAX];
+    int started, i, ret = 0;
+
+    for (started = 1; started < nblocks; started++) {
+        if (pthread_create(&tid[started], NULL, body, &blk[started]) != 0) {
+            break;
+        }
+    }
+    body(&blk[0]);
+    for (i = started; i < nblocks; i++) {
+        body(&blk[i]);
+    }
+    for (i = 1; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    for (i = 0; i < nblocks; i++) {
+        if (blk[i].ret != 0) {
+            ret = blk[i].ret;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief: replace the filters of inflated image data with a per row
+ *         choice that usually deflates smaller, on several threads
+ * @param: rows U8* height scanlines of png_stride() bytes, filter first,
+ *         with filters that may refer to the row above
+ * @param: height unsigned long rows in rows
+ * @param: p_ihdr const struct data_IHDR* the image's IHDR
+ * @param: nthreads int number of threads, <= 0 for one per online CPU
+ * @return =0 on success
+ *         <>0 on a bad color type or filter type, or out of memory;
+ *         rows is then partly changed
+ * NOTE: the rows are unfiltered first, in blocks that each start at a
+ *       row filtered with None or Sub (an input's first row after
+ *       png_detach_first_row() is one), then filtered in even blocks.
+ *       Indexed colour and bit depths below 8 get None throughout, as
+ *       the PNG spec recommends for them.
+ */
+int png_refilter(U8 *rows, unsigned long height, const struct data_IHDR *p_ihdr, int nthreads)
+{
+    return png_refilter_with(rows, height, p_ihdr, nthreads, png_kernel_best());
+}
+
+/**
+ * @brief: png_refilter() with the kernel set given, for comparing them
+ */
+int png_refilter_with(U8 *rows, unsigned long height,
+                      const struct data_IHDR *p_ihdr, int nthreads, int kernel)
+{
+    struct refilter_block blk[PNG_REFILTER_MAX];
+    unsigned long stride = png_stride(p_ihdr);
+    unsigned long start, next, per;
+    U8 *above;
+    int nblocks, i, ret;
+
+    if (stride == 0) {
+        return -1;
+    }
+    if (height == 0) {
+        return 0;
+    }
+    if (kernel > PNG_KERNEL_SCALAR) {
+        int best = png_kernel_best();
+        kernel = kernel < best ? kernel : best;
+    }
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (int) ncpu : 1;
+    }
+    if (nthreads > PNG_REFILTER_MAX) {
+        nthreads = PNG_REFILTER_MAX;
+    }
+    /* no thread for less than PNG_REFILTER_MIN bytes */
+    if ((unsigned long) nthreads > height * stride / PNG_REFILTER_MIN + 1) {
+        nthreads = height * stride / PNG_REFILTER_MIN + 1;
+    }
+    if ((unsigned long) nthreads > height) {
+        nthreads = height;
+    }
+    per = height / nthreads;
+
+    /* first pass: unfilter, blocks cut at the first None or Sub row at
+       or after each even split */
+    for (nblocks = 0, start = 0; start < height; nblocks++, start = next) {
+        next = (nblocks + 1 < nthreads) ? (nblocks + 1) * per : height;
+        next = next > start + 1 ? next : start + 1;
+        while (next < height && rows[next * stride] > PNG_FILTER_SUB) {
+            next++;
+        }
+        blk[nblocks].rows = rows + start * stride;
+        blk[nblocks].nrows = next - start;
+        blk[nblocks].p_ihdr = p_ihdr;
+        blk[nblocks].kernel = kernel;
+    }
+    ret = refilter_pass(blk, nblocks, unfilter_block);
+    if (ret != 0) {
+        return ret;
+    }
+
+    /* second pass: filter, even blocks, each with a copy of the row
+       above it as it is now (unfiltered) */
+    above = calloc(nthreads, stride - 1 > 0 ? stride - 1 : 1);
+    if (above == NULL) {
+        return -1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        start = i * per;
+        blk[i].rows = rows + start * stride;
+        blk[i].nrows = (i == nthreads - 1) ? height - start : per;
+        blk[i].above = above + i * (stride - 1);
+        blk[i].p_ihdr = p_ihdr;
+        blk[i].kernel = kernel;
+        blk[i].keep_none = (p_ihdr->color_type == 3 || p_ihdr->bit_depth < 8);
+        if (start > 0) {
+            memcpy(above + i * (stride - 1), rows + (start - 1) * stride + 1, stride - 1);
+        }
+    }
+    ret = refilter_pass(blk, nthreads, filter_block);
+    free(above);
+    return ret;
+}
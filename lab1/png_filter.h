@@ -0,0 +1,28 @@
+/**
+ * @file: png_filter.h
+ * @brief: PNG scanline filters, undone or chosen anew in place on
+ *         inflated image data
+ */
+
+#pragma once
+
+#include "lab_png.h"
+
+/* kernel sets, each one a superset of the one before */
+#define PNG_KERNEL_SCALAR 0  /* plain C, any bpp: the reference           */
+#define PNG_KERNEL_SSE2   1  /* SSE2, a kernel per bpp of 1, 2, 3, 4, 6, 8 */
+#define PNG_KERNEL_AVX2   2  /* as SSE2, with 256 bit Up                  */
+
+#define PNG_REFILTER_MAX 64          /* most threads png_refilter() uses  */
+#define PNG_REFILTER_MIN (256 * 1024) /* fewest bytes of rows per thread   */
+
+int png_kernel_best(void);
+int png_unfilter(U8 *rows, unsigned long height, const struct data_IHDR *p_ihdr);
+int png_unfilter_with(U8 *rows, unsigned long height,
+                      const struct data_IHDR *p_ihdr, int kernel);
+unsigned long png_pack_rows(U8 *rows, unsigned long height,
+                            const struct data_IHDR *p_ihdr);
+int png_refilter(U8 *rows, unsigned long height, const struct data_IHDR *p_ihdr,
+                 int nthreads);
+int png_refilter_with(U8 *rows, unsigned long height,
+                      const struct data_IHDR *p_ihdr, int nthreads, int kernel);
@@ -0,0 +1,133 @@
+/**
+ * @file: crc_test.c
+ * @brief: checks crc.c, as built with the CRC_SLICE and CRC_NO_CLMUL it
+ *         was compiled with, against a bit-at-a-time CRC and zlib's
+ *         crc32(): whole files given on the command line, random lengths
+ *         0..4K at odd alignments, crc_combine() of random splits and
+ *         crc_parallel() against a single pass
+ * Run by "make check", once per build of crc.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+#include "crc.h"
+
+#define RAND_LEN_MAX 4096              /* longest random buffer           */
+#define RAND_ROUNDS  2000              /* random buffers checked           */
+#define PAR_LEN (3 * CRC_PARALLEL_SEG + 12345) /* splits on 2 and 3 threads */
+
+static int g_failed = 0;  /* checks that failed  */
+static int g_checks = 0;  /* checks run          */
+
+/* the CRC of the PNG spec, one bit at a time: the reference */
+static unsigned long crc_bitwise(const unsigned char *buf, unsigned long len)
+{
+    unsigned long c = 0xffffffffUL;
+    unsigned long i;
+    int k;
+
+    for (i = 0; i < len; i++) {
+        c ^= buf[i];
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        }
+    }
+    return c ^ 0xffffffffUL;
+}
+
+static void expect(unsigned long got, unsigned long want, const char *what,
+                   unsigned long len, unsigned long align)
+{
+    g_checks++;
+    if (got != want) {
+        g_failed++;
+        fprintf(stderr, "%s: len %lu align %lu: got %08lx, want %08lx\n",
+                what, len, align, got, want);
+    }
+}
+
+/* crc() and a running CRC fed in two pieces, against both references */
+static void check_buf(unsigned char *buf, unsigned long len, unsigned long align)
+{
+    unsigned long want = crc_bitwise(buf, len);
+    unsigned long cut = len > 0 ? (unsigned long) rand() % (len + 1) : 0;
+    struct crc_ctx ctx;
+
+    expect(crc32(0L, buf, len), want, "zlib crc32", len, align);
+    expect(crc(buf, (int) len), want, "crc", len, align);
+    crc_init(&ctx);
+    crc_update(&ctx, buf, (int) cut);
+    crc_update(&ctx, buf + cut, (int) (len - cut));
+    expect(crc_final(&ctx), want, "crc_update", len, align);
+    expect(crc_combine(crc(buf, (int) cut), crc(buf + cut, (int) (len - cut)),
+                       len - cut), want, "crc_combine", len, align);
+}
+
+static void check_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char *buf;
+    long size;
+
+    if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+        perror(path);
+        exit(2);
+    }
+    rewind(fp);
+    buf = malloc(size + 1);
+    if (buf == NULL || fread(buf + 1, 1, size, fp) != (size_t) size) {
+        perror(path);
+        exit(2);
+    }
+    fclose(fp);
+    check_buf(buf + 1, size, 1);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char *buf = malloc(PAR_LEN);
+    unsigned long i, want;
+    int n;
+
+    if (buf == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    srand(252);
+    for (i = 0; i < PAR_LEN; i++) {
+        buf[i] = rand() & 0xff;
+    }
+    for (n = 1; n < argc; n++) {
+        check_file(argv[n]);
+    }
+    for (n = 0; n < RAND_ROUNDS; n++) {
+        unsigned long len = (unsigned long) rand() % (RAND_LEN_MAX + 1);
+        unsigned long align = (unsigned long) rand() % 64;
+
+        check_buf(buf + align, len, align);
+    }
+
+    want = crc_bitwise(buf, PAR_LEN);
+    for (n = 0; n <= 4; n++) {
+        struct crc_ctx ctx;
+
+        expect(crc_parallel(buf, PAR_LEN, n), want, "crc_parallel", PAR_LEN, n);
+        crc_init(&ctx);
+        crc_update(&ctx, buf, 7);
+        crc_update_parallel(&ctx, buf + 7, PAR_LEN - 7, n);
+        expect(crc_final(&ctx), want, "crc_update_parallel", PAR_LEN, n);
+    }
+    free(buf);
+
+    printf("crc (CRC_SLICE=%d%s): %d of %d checks passed\n", CRC_SLICE,
+#ifdef CRC_NO_CLMUL
+           ", no CLMUL",
+#else
+           "",
+#endif
+           g_checks - g_failed, g_checks);
+    return g_failed == 0 ? 0 : 1;
+}
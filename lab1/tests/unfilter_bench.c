@@ -0,0 +1,168 @@
+/**
+ * @file: unfilter_bench.c
+ * @brief: times png_unfilter_with() for each kernel set, per bytes per
+ *         pixel and filter type, and png_refilter_with() per bytes per
+ *         pixel, on random rows; every kernel's output is checked
+ *         against the scalar one on the way
+ * Run by "make bench", the sizes and rounds can be given:
+ *         unfilter_bench.out [width [height [rounds]]]
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "png_filter.h"
+
+#define BENCH_WIDTH  1024 /* pixels per row unless given */
+#define BENCH_HEIGHT 1024 /* rows unless given           */
+#define BENCH_ROUNDS 5    /* best of this many timings   */
+#define BENCH_MIXED  5    /* "filter" for a random mix of all five */
+
+/* an IHDR for each bpp the SIMD kernels are specialized for */
+static const struct {
+    U32 bpp;
+    U8 color_type;
+    U8 bit_depth;
+} g_formats[] = {
+    { 1, 0, 8 },   /* greyscale                 */
+    { 2, 4, 8 },   /* greyscale with alpha      */
+    { 3, 2, 8 },   /* truecolour                */
+    { 4, 6, 8 },   /* truecolour with alpha     */
+    { 6, 2, 16 },  /* truecolour, 16 bit        */
+    { 8, 6, 16 },  /* truecolour with alpha, 16 */
+};
+
+static const char *g_kernel_names[] = { "scalar", "sse2", "avx2" };
+static const char *g_filter_names[] = {
+    "None", "Sub", "Up", "Avg", "Paeth", "mixed"
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* best time of rounds runs of png_unfilter_with(), or of
+   png_refilter_with() on one thread if refilter is set, each on a fresh
+   copy of src; the last result is left in work */
+static double time_kernel(U8 *work, const U8 *src, unsigned long len,
+                          const struct data_IHDR *p_ihdr, int kernel,
+                          int refilter, int rounds)
+{
+    double best = 1e30;
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        double t0;
+        int ret;
+
+        memcpy(work, src, len);
+        t0 = now();
+        ret = refilter ? png_refilter_with(work, p_ihdr->height, p_ihdr, 1, kernel)
+                       : png_unfilter_with(work, p_ihdr->height, p_ihdr, kernel);
+        t0 = now() - t0;
+        if (ret != 0) {
+            fprintf(stderr, "kernel %s failed\n", g_kernel_names[kernel]);
+            exit(2);
+        }
+        best = t0 < best ? t0 : best;
+    }
+    return best;
+}
+
+/* one line of the table: MB/s of every kernel set this CPU runs and the
+   speed-up over scalar; 0 if every kernel gave the scalar result */
+static int bench_line(const char *what, U8 *src, unsigned long len,
+                      const struct data_IHDR *p_ihdr, int refilter, int rounds)
+{
+    U8 *work = malloc(len);
+    U8 *ref = malloc(len);
+    int best = png_kernel_best();
+    double scalar = 0;
+    int k, bad = 0;
+
+    if (work == NULL || ref == NULL) {
+        perror("malloc");
+        exit(2);
+    }
+    printf("  %-8s", what);
+    for (k = PNG_KERNEL_SCALAR; k <= PNG_KERNEL_AVX2; k++) {
+        double t;
+
+        if (k > best) {
+            printf("  %8s %6s", "n/a", "");
+            continue;
+        }
+        t = time_kernel(work, src, len, p_ihdr, k, refilter, rounds);
+        if (k == PNG_KERNEL_SCALAR) {
+            scalar = t;
+            memcpy(ref, work, len);
+        } else if (memcmp(ref, work, len) != 0) {
+            bad = 1;
+        }
+        printf("  %8.0f x%-5.2f", len / t / 1e6, scalar / t);
+    }
+    printf("%s\n", bad ? "  MISMATCH" : "");
+    free(work);
+    free(ref);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    U32 width = argc > 1 ? (U32) atoi(argv[1]) : BENCH_WIDTH;
+    U32 height = argc > 2 ? (U32) atoi(argv[2]) : BENCH_HEIGHT;
+    int rounds = argc > 3 ? atoi(argv[3]) : BENCH_ROUNDS;
+    int bad = 0;
+    size_t f;
+
+    if (width == 0 || height == 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [width [height [rounds]]]\n", argv[0]);
+        return 2;
+    }
+    srand(252);
+    printf("%u x %u pixels, best of %d, MB/s of filtered rows"
+           " and speed-up over scalar; best kernel set here: %s\n",
+           width, height, rounds, g_kernel_names[png_kernel_best()]);
+    printf("  %-8s  %15s  %15s  %15s\n", "filter", "scalar", "sse2", "avx2");
+
+    for (f = 0; f < sizeof(g_formats) / sizeof(g_formats[0]); f++) {
+        struct data_IHDR ihdr;
+        unsigned long stride, len, i;
+        U8 *rows;
+        int filter;
+
+        memset(&ihdr, 0, sizeof(ihdr));
+        ihdr.width = width;
+        ihdr.height = height;
+        ihdr.color_type = g_formats[f].color_type;
+        ihdr.bit_depth = g_formats[f].bit_depth;
+        stride = png_stride(&ihdr);
+        len = stride * height;
+        rows = malloc(len);
+        if (rows == NULL) {
+            perror("malloc");
+            return 2;
+        }
+        for (i = 0; i < len; i++) {
+            rows[i] = rand() & 0xff;
+        }
+        printf("bpp %u\n", g_formats[f].bpp);
+        for (filter = PNG_FILTER_SUB; filter <= BENCH_MIXED; filter++) {
+            for (i = 0; i < height; i++) {
+                rows[i * stride] = filter == BENCH_MIXED ? rand() % 5 : filter;
+            }
+            bad |= bench_line(g_filter_names[filter], rows, len, &ihdr, 0, rounds);
+        }
+        /* the mixed rows once more, filtered anew */
+        bad |= bench_line("refilter", rows, len, &ihdr, 1, rounds);
+        free(rows);
+    }
+    return bad;
+}
@@ -0,0 +1,226 @@
+/**
+ * @file: zutil_test.c
+ * @brief: checks that the per thread inflate streams of zutil.c start
+ *         clean when reused: an inflate that stops early must not leave
+ *         input behind for the next one on the same thread; and that a
+ *         join's zlib header covers the largest window of its streams
+ *         and that z_join_add_head() re-encodes a stream's head correctly;
+ *         and that inputs past 4 GiB aren't cut to zlib's 32 bit counts
+ * Run by "make check".
+ */
+
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS and MAP_NORESERVE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "zutil.h"
+
+#define DATA_LEN (256 * 1024)  /* bytes deflated for the tests */
+#define HUGE_LEN (0x100000000ULL + 64) /* source_len cut to 64 in a uInt */
+
+static int g_failed = 0;  /* checks that failed  */
+static int g_checks = 0;  /* checks run          */
+
+/* deflate source with a window of 1 << wbits bytes */
+static int def_window(U8 *dest, U64 *dest_len, U8 *source, U64 source_len,
+                      int wbits)
+{
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, wbits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    strm.next_in = source;
+    strm.avail_in = source_len;
+    strm.next_out = dest;
+    strm.avail_out = mem_def_bound(source_len);
+    ret = deflate(&strm, Z_FINISH);
+    *dest_len = strm.total_out;
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/* inflate a zlib stream with the window its header declares and compare
+   it with want; the output goes out 1K at a time so that zlib, like a
+   decoder with only that window to go on, can't reach further back */
+static int inf_as_declared(U8 *source, U64 source_len, const U8 *want,
+                           U64 want_len)
+{
+    z_stream strm;
+    U8 *out = malloc(want_len + 1);
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    if (out == NULL || inflateInit2(&strm, 0) != Z_OK) {
+        free(out);
+        return -1;
+    }
+    strm.next_in = source;
+    strm.avail_in = source_len;
+    strm.next_out = out;
+    do {
+        U64 room = want_len + 1 - strm.total_out;
+
+        strm.avail_out = room < 1024 ? room : 1024;
+        ret = inflate(&strm, Z_NO_FLUSH);
+    } while (ret == Z_OK && strm.avail_out == 0);
+    ret = (ret == Z_STREAM_END && strm.total_out == want_len &&
+           memcmp(out, want, want_len) == 0) ? 0 : -1;
+    inflateEnd(&strm);
+    free(out);
+    return ret;
+}
+
+static void expect(int ok, const char *what)
+{
+    g_checks++;
+    if (!ok) {
+        g_failed++;
+        fprintf(stderr, "FAILED: %s\n", what);
+    }
+}
+
+int main(void)
+{
+    U8 *data = malloc(DATA_LEN);
+    U8 *def = malloc(mem_def_bound(DATA_LEN));
+    U8 *out = malloc(DATA_LEN);
+    U8 *small = malloc(mem_def_bound(DATA_LEN));
+    U8 *both = malloc(2 * DATA_LEN);
+    U8 head[16];
+    U64 def_len, out_len, head_len, small_len, join_len;
+    struct z_join zj;
+    int i, ret;
+
+    if (data == NULL || def == NULL || out == NULL || small == NULL ||
+        both == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    srand(252);
+    for (i = 0; i < DATA_LEN; i++) {
+        data[i] = (rand() % 7 == 0) ? rand() & 0xff : i & 0x3f;
+    }
+    if (mem_def(def, &def_len, data, DATA_LEN, Z_DEFAULT_COMPRESSION) != 0) {
+        fprintf(stderr, "mem_def failed\n");
+        return 2;
+    }
+
+    /* mem_inf_head() reads a few bytes and leaves most of its input
+       unread. The truncated stream handed to mem_inf() next is the
+       front of the full one, so an inflate that also took the leftover
+       input would run on past source_len and succeed. */
+    head_len = sizeof(head);
+    ret = mem_inf_head(head, &head_len, def, def_len);
+    expect(ret == 0 && head_len == sizeof(head) &&
+           memcmp(head, data, sizeof(head)) == 0, "mem_inf_head");
+    ret = mem_inf(out, &out_len, def, def_len / 2);
+    expect(ret != 0, "mem_inf of a truncated stream after mem_inf_head");
+
+    /* and the stream after that one still inflates in full */
+    ret = mem_inf(out, &out_len, def, def_len);
+    expect(ret == 0 && out_len == DATA_LEN &&
+           memcmp(out, data, DATA_LEN) == 0, "mem_inf after a failed one");
+
+    /* z_join_add() walks its streams on the raw inflate stream, a
+       truncated one must be refused there too */
+    z_join_init(&zj);
+    expect(z_join_add(&zj, def, def_len) == 0, "z_join_add");
+    expect(z_join_add(&zj, def, def_len / 2) != 0,
+           "z_join_add of a truncated stream");
+    expect(z_join_add(&zj, def, def_len) == 0, "z_join_add after a failed one");
+    z_join_free(&zj);
+
+    /* a 512 byte window stream first, a 32K one after it: the join must
+       not keep the first one's header */
+    expect(def_window(small, &small_len, data, DATA_LEN, 9) == 0 &&
+           small[0] >> 4 == 1, "deflate with a 512 byte window");
+    memcpy(both, data, DATA_LEN);
+    memcpy(both + DATA_LEN, data, DATA_LEN);
+    z_join_init(&zj);
+    ret = z_join_add(&zj, small, small_len);
+    if (ret == 0) {
+        ret = z_join_add(&zj, def, def_len);
+    }
+    if (ret == 0) {
+        ret = z_join_end(&zj, &join_len);
+    }
+    expect(ret == 0 && zj.buf[0] >> 4 == def[0] >> 4 &&
+           inf_as_declared(zj.buf, join_len, both, 2 * DATA_LEN) == 0,
+           "z_join header window");
+    z_join_free(&zj);
+
+    /* a new head for the second stream, on top of the first one: every
+       bit phase the spliced blocks can start at shows up over a few
+       head lengths */
+    for (i = 1; i <= 5; i++) {
+        U64 n = i * 1000;
+        U8 new_head[5000];
+
+        memcpy(both, data, DATA_LEN);
+        memcpy(both + DATA_LEN, data, DATA_LEN);
+        memset(new_head, i, n);
+        memcpy(both + DATA_LEN, new_head, n);
+        z_join_init(&zj);
+        ret = z_join_add(&zj, def, def_len);
+        if (ret == 0) {
+            ret = z_join_add_head(&zj, def, def_len, new_head, n,
+                                  6 + i % 3);
+        }
+        if (ret == 0) {
+            ret = z_join_end(&zj, &join_len);
+        }
+        expect(ret == 0 && join_len < 2 * def_len + 2 * n &&
+               inf_as_declared(zj.buf, join_len, both, 2 * DATA_LEN) == 0,
+               "z_join_add_head");
+        z_join_free(&zj);
+    }
+
+    /* a source_len past 4 GiB with the stream at its front, the rest an
+       untouched, unbacked mapping: cut to 32 bits it would be 64 bytes */
+    if (sizeof(size_t) > 4) {
+        U8 *huge = mmap(NULL, HUGE_LEN, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        U8 *buf = NULL;
+        U64 len = 0, cap = 0;
+
+        if (huge == MAP_FAILED) {
+            fprintf(stderr, "no 4 GiB mapping, large input checks skipped\n");
+        } else {
+            memcpy(huge, def, def_len);
+            out_len = DATA_LEN;
+            ret = mem_inf_head(out, &out_len, huge, HUGE_LEN);
+            expect(ret == 0 && out_len == DATA_LEN &&
+                   memcmp(out, data, DATA_LEN) == 0,
+                   "mem_inf_head past 4 GiB");
+            ret = mem_inf_append(&buf, &len, &cap, huge, HUGE_LEN, DATA_LEN);
+            expect(ret == 0 && len == DATA_LEN &&
+                   memcmp(buf, data, DATA_LEN) == 0,
+                   "mem_inf_append past 4 GiB");
+            z_join_init(&zj);
+            ret = z_join_add(&zj, huge, HUGE_LEN);
+            if (ret == 0) {
+                ret = z_join_end(&zj, &join_len);
+            }
+            expect(ret == 0 && inf_as_declared(zj.buf, join_len, data,
+                                               DATA_LEN) == 0,
+                   "z_join_add past 4 GiB");
+            z_join_free(&zj);
+            free(buf);
+            munmap(huge, HUGE_LEN);
+        }
+    }
+
+    free(data);
+    free(def);
+    free(out);
+    free(small);
+    free(both);
+    printf("zutil: %d of %d checks passed\n", g_checks - g_failed, g_checks);
+    return g_failed == 0 ? 0 : 1;
+}
@@ -4,13 +4,194 @@
  *        at https://www.zlib.net/zlib_how.html
  */
 
+#define _POSIX_C_SOURCE 200112L /* for sysconf() */
+
 #include <stdio.h>
+#include <stdlib.h>   /* for malloc(), realloc(), free() */
+#include <pthread.h>  /* for the per-thread context key  */
+#include <unistd.h>   /* for sysconf()                   */
 #include "zutil.h"
 
+/******************************************************************************
+ * REUSABLE ZLIB STATE
+ * deflateInit()/inflateInit() allocate roughly 256K/40K of state. A z_ctx
+ * keeps one deflate and one inflate stream alive and rewinds them with
+ * deflateReset()/inflateReset() between calls instead. mem_def(),
+ * mem_inf() and mem_inf_alloc() use the calling thread's context, see
+ * z_ctx_thread(); the *_ctx() variants take an explicit one.
+ *****************************************************************************/
+
+static pthread_key_t z_ctx_key;
+static pthread_once_t z_ctx_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief: set up an empty context, the streams are created on first use
+ */
+void z_ctx_init(struct z_ctx *ctx)
+{
+    ctx->def_ready = 0;
+    ctx->def_level = 0;
+    ctx->raw_ready = 0;
+    ctx->raw_level = 0;
+    ctx->inf_ready = 0;
+    ctx->rinf_ready = 0;
+}
+
+/**
+ * @brief: release the zlib state held by a context
+ */
+void z_ctx_free(struct z_ctx *ctx)
+{
+    if (ctx->def_ready) {
+        (void) deflateEnd(&ctx->def);
+    }
+    if (ctx->raw_ready) {
+        (void) deflateEnd(&ctx->raw);
+    }
+    if (ctx->inf_ready) {
+        (void) inflateEnd(&ctx->inf);
+    }
+    if (ctx->rinf_ready) {
+        (void) inflateEnd(&ctx->rinf);
+    }
+    z_ctx_init(ctx);
+}
+
+/* thread exit destructor for the per-thread context */
+static void z_ctx_destroy(void *p)
+{
+    z_ctx_free(p);
+    free(p);
+}
+
+static void z_ctx_make_key(void)
+{
+    (void) pthread_key_create(&z_ctx_key, z_ctx_destroy);
+}
+
+/**
+ * @brief: the calling thread's context, created on first use and freed
+ *         automatically when the thread exits
+ * @return pointer to the context, NULL if out of memory
+ */
+struct z_ctx *z_ctx_thread(void)
+{
+    struct z_ctx *ctx;
+
+    (void) pthread_once(&z_ctx_once, z_ctx_make_key);
+    ctx = pthread_getspecific(z_ctx_key);
+    if (ctx == NULL) {
+        ctx = malloc(sizeof(struct z_ctx));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        z_ctx_init(ctx);
+        if (pthread_setspecific(z_ctx_key, ctx) != 0) {
+            free(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+/* ready the context's deflate stream for a new input at level */
+static int z_ctx_def(struct z_ctx *ctx, int level)
+{
+    int ret;
+
+    if (ctx->def_ready && ctx->def_level == level) {
+        return deflateReset(&ctx->def);
+    }
+    if (ctx->def_ready) { /* level changed, start over */
+        (void) deflateEnd(&ctx->def);
+        ctx->def_ready = 0;
+    }
+    ctx->def.zalloc = Z_NULL;
+    ctx->def.zfree  = Z_NULL;
+    ctx->def.opaque = Z_NULL;
+    ret = deflateInit(&ctx->def, level);
+    if (ret == Z_OK) {
+        ctx->def_ready = 1;
+        ctx->def_level = level;
+    }
+    return ret;
+}
+
+/* ready the context's raw (no zlib header/trailer) deflate stream */
+static int z_ctx_raw(struct z_ctx *ctx, int level)
+{
+    int ret;
+
+    if (ctx->raw_ready && ctx->raw_level == level) {
+        return deflateReset(&ctx->raw);
+    }
+    if (ctx->raw_ready) {
+        (void) deflateEnd(&ctx->raw);
+        ctx->raw_ready = 0;
+    }
+    ctx->raw.zalloc = Z_NULL;
+    ctx->raw.zfree  = Z_NULL;
+    ctx->raw.opaque = Z_NULL;
+    ret = deflateInit2(&ctx->raw, level, Z_DEFLATED, -MAX_WBITS, 8,
+                       Z_DEFAULT_STRATEGY);
+    if (ret == Z_OK) {
+        ctx->raw_ready = 1;
+        ctx->raw_level = level;
+    }
+    return ret;
+}
+
+/* ready the context's inflate stream for a new input */
+static int z_ctx_inf(struct z_ctx *ctx)
+{
+    int ret;
+
+    if (ctx->inf_ready) {
+        /* inflateReset() leaves avail_in alone, drop what the last
+           input left unread so it isn't counted as part of this one */
+        ctx->inf.avail_in = 0;
+        ctx->inf.next_in = Z_NULL;
+        return inflateReset(&ctx->inf);
+    }
+    ctx->inf.zalloc = Z_NULL;
+    ctx->inf.zfree = Z_NULL;
+    ctx->inf.opaque = Z_NULL;
+    ctx->inf.avail_in = 0;        /* no input data being provided   */
+    ctx->inf.next_in = Z_NULL;    /* no input data being provided   */
+    ret = inflateInit(&ctx->inf);
+    if (ret == Z_OK) {
+        ctx->inf_ready = 1;
+    }
+    return ret;
+}
+
+/* ready the context's raw inflate stream for a new input */
+static int z_ctx_rinf(struct z_ctx *ctx)
+{
+    int ret;
+
+    if (ctx->rinf_ready) {
+        /* as in z_ctx_inf() */
+        ctx->rinf.avail_in = 0;
+        ctx->rinf.next_in = Z_NULL;
+        return inflateReset(&ctx->rinf);
+    }
+    ctx->rinf.zalloc = Z_NULL;
+    ctx->rinf.zfree = Z_NULL;
+    ctx->rinf.opaque = Z_NULL;
+    ctx->rinf.avail_in = 0;
+    ctx->rinf.next_in = Z_NULL;
+    ret = inflateInit2(&ctx->rinf, -MAX_WBITS);
+    if (ret == Z_OK) {
+        ctx->rinf_ready = 1;
+    }
+    return ret;
+}
+
 /**
  * @brief: deflate in memory data from source to dest 
- * @param: dest U8* output buffer, caller supplies, should be big enough
- *         to hold the deflated data
+ * @param: dest U8* output buffer, caller supplies, at least
+ *         mem_def_bound(source_len) bytes
  * @param: dest_len, U64* output parameter, length of deflated data
  * @param: source U8* source buffer, contains data to be deflated
  * @param: source_len U64 length of source data
@@ -23,48 +204,63 @@
  */
 int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
 {
-    z_stream strm;    /* pass info. to and from zlib routines   */
-    U8 out[CHUNK];    /* output buffer for deflate()            */
-    int ret = 0;      /* zlib return code                       */
-    int have = 0;     /* amount of data returned from deflate() */
-    int def_len = 0;  /* accumulated deflated data length       */
-    U8 *p_dest = dest;/* first empty slot in dest buffer        */
+    struct z_ctx *ctx = z_ctx_thread();
 
-    
-    strm.zalloc = Z_NULL;
-    strm.zfree  = Z_NULL;
-    strm.opaque = Z_NULL;
+    if (ctx == NULL) {
+        return Z_MEM_ERROR;
+    }
+    return mem_def_ctx(ctx, dest, dest_len, source, source_len, level);
+}
+
+/**
+ * @brief: mem_def() using the deflate stream of an explicit context
+ * @param: ctx struct z_ctx* context, not shared with other threads
+ */
+int mem_def_ctx(struct z_ctx *ctx, U8 *dest, U64 *dest_len, U8 *source,
+                U64 source_len, int level)
+{
+    z_stream *strm;   /* pass info. to and from zlib routines   */
+    int ret = 0;      /* zlib return code                       */
+    U64 in_left;      /* source bytes not yet handed to zlib    */
+    U64 out_left;     /* room left in dest                      */
 
-    ret = deflateInit(&strm, level);
+    ret = z_ctx_def(ctx, level);
     if (ret != Z_OK) {
         return ret;
     }
+    strm = &ctx->def;
 
-    /* set input data stream */
-    strm.avail_in = source_len;
-    strm.next_in = source;
-
-    /* call deflate repetitively since the out buffer size is fixed
-       and the deflated output data length is not known ahead of time */
+    /* deflate straight into dest, there is no intermediate buffer.
+       dest must hold mem_def_bound(source_len) bytes, which is at least
+       deflateBound() so Z_FINISH always completes. avail_in/avail_out
+       are 32 bits wide, so very large buffers are handed over in steps. */
+    in_left = source_len;
+    out_left = deflateBound(strm, source_len);
+    strm->next_in = source;
+    strm->next_out = dest;
+    strm->avail_in = 0;
+    strm->avail_out = 0;
 
     do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-        ret = deflate(&strm, Z_FINISH); /* source contains the whole data */
+        U64 step;
+
+        step = in_left < Z_STEP_MAX ? in_left : Z_STEP_MAX;
+        strm->avail_in += step;
+        in_left -= step;
+        step = out_left < Z_STEP_MAX ? out_left : Z_STEP_MAX;
+        strm->avail_out += step;
+        out_left -= step;
+        ret = deflate(strm, in_left == 0 ? Z_FINISH : Z_NO_FLUSH);
         assert(ret != Z_STREAM_ERROR);
-        have = CHUNK - strm.avail_out; 
-        memcpy(p_dest, out, have);
-        p_dest += have;  /* advance to the next free byte to write */
-        def_len += have; /* increment deflated data length         */
-    } while (strm.avail_out == 0);
-
-    assert(strm.avail_in == 0);   /* all input will be used  */
-    assert(ret == Z_STREAM_END);  /* stream will be complete */
-
-    /* clean up and return */
-    (void) deflateEnd(&strm);
-    *dest_len = def_len;
-    return Z_OK;
+        in_left += strm->avail_in;   /* give back what was not consumed */
+        strm->avail_in = 0;
+        out_left += strm->avail_out;
+        strm->avail_out = 0;
+    } while (ret != Z_STREAM_END && (ret == Z_OK || ret == Z_BUF_ERROR) &&
+             out_left > 0);
+
+    *dest_len = strm->total_out;
+    return (ret == Z_STREAM_END) ? Z_OK : Z_BUF_ERROR;
 }
 
 /**
@@ -77,60 +273,878 @@ int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
  * 
  * @return =0  on success
  *         <>0 error
+ * NOTE: inflates straight into dest, there is no intermediate buffer.
  */
 int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
 {
-    z_stream strm;    /* pass info. to and from zlib routines   */
-    U8 out[CHUNK];    /* output buffer for inflate()            */
+    struct z_ctx *ctx = z_ctx_thread();
+
+    if (ctx == NULL) {
+        return Z_MEM_ERROR;
+    }
+    return mem_inf_ctx(ctx, dest, dest_len, source, source_len);
+}
+
+/**
+ * @brief: mem_inf() using the inflate stream of an explicit context
+ * @param: ctx struct z_ctx* context, not shared with other threads
+ */
+int mem_inf_ctx(struct z_ctx *ctx, U8 *dest, U64 *dest_len, U8 *source,
+                U64 source_len)
+{
+    z_stream *strm;   /* pass info. to and from zlib routines   */
     int ret = 0;      /* zlib return code                       */
-    int have = 0;     /* amount of data returned from inflate() */
-    int inf_len = 0;  /* accumulated inflated data length       */
-    U8 *p_dest = dest;/* first empty slot in dest buffer        */
-
-    /* allocate inflate state 8 */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;        /* no input data being provided   */
-    strm.next_in = Z_NULL;    /* no input data being provided   */
-    ret = inflateInit(&strm);
+    U64 in_left;      /* source bytes not yet handed to zlib    */
+
+    ret = z_ctx_inf(ctx);
     if (ret != Z_OK) {
         return ret;
     }
+    strm = &ctx->inf;
 
-    /* set input data stream */
-    strm.avail_in = source_len;
-    strm.next_in = source;
+    /* set input data stream, output goes directly to dest */
+    in_left = source_len;
+    strm->next_in = source;
+    strm->avail_in = 0;
+    strm->next_out = dest;
 
-    /* run inflate() on input until output buffer not full */
+    /* run inflate() until the stream ends or the input runs out */
     do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
+        U64 step = in_left < Z_STEP_MAX ? in_left : Z_STEP_MAX;
+
+        strm->avail_in += step;
+        in_left -= step;
+        strm->avail_out = Z_STEP_MAX;
 
         /* zlib format is self-terminating, no need to flush */
-        ret = inflate(&strm, Z_NO_FLUSH);
+        ret = inflate(strm, Z_NO_FLUSH);
         assert(ret != Z_STREAM_ERROR);    /* state no t clobbered */
         switch(ret) {
         case Z_NEED_DICT:
             ret = Z_DATA_ERROR;  /* and fall through */
         case Z_DATA_ERROR:
         case Z_MEM_ERROR:
-            (void) inflateEnd(&strm);
-			return ret;
-        }
-        have = CHUNK - strm.avail_out;
-        memcpy(p_dest, out, have);
-        p_dest += have;  /* advance to the next free byte to write */
-        inf_len += have; /* increment inflated data length         */
-    } while (strm.avail_out == 0 );
-
-    /* clean up and return */
-    (void) inflateEnd(&strm);
-    *dest_len = inf_len;
+            return ret;
+        }
+    } while (ret != Z_STREAM_END && (strm->avail_in > 0 || in_left > 0 ||
+                                     strm->avail_out == 0));
+
+    *dest_len = strm->total_out;
     
     return (ret == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
 }
 
+/**
+ * @brief: upper bound on the output of mem_def() and mem_def_parallel()
+ *         for source_len input bytes, size dest with this instead of
+ *         guessing from the image
+ * @param: source_len U64 length of the data to be deflated
+ * @return worst case deflated length, for any compression level
+ */
+U64 mem_def_bound(U64 source_len)
+{
+    /* room for the sync flush marker and block overhead of every slice
+       in case the data goes through mem_def_parallel() */
+    return compressBound(source_len) + (source_len / PDEF_SLICE + 1) * 16;
+}
+
+/**
+ * @brief: inflate in memory data from source into a buffer that is
+ *         allocated here and grown as needed, so the caller does not
+ *         have to guess (and zero fill) an output size
+ * @param: dest U8** output parameter, malloc'd buffer holding the inflated
+ *         data, caller frees. Set to NULL on error.
+ * @param: dest_len U64* output parameter, length of inflated data
+ * @param: source U8* source buffer, contains zlib data to be inflated
+ * @param: source_len U64 length of source data
+ * @param: expected_len U64 exact inflated length if known (e.g. the
+ *         scanline bytes given by IHDR) so a single allocation suffices,
+ *         0 if unknown
+ * @return =0  on success
+ *         <>0 error
+ */
+int mem_inf_alloc(U8 **dest, U64 *dest_len, U8 *source, U64 source_len,
+                  U64 expected_len)
+{
+    U64 cap = 0;
+    int ret;
+
+    *dest = NULL;
+    *dest_len = 0;
+    ret = mem_inf_append(dest, dest_len, &cap, source, source_len,
+                         expected_len);
+    if (ret != Z_OK) {
+        free(*dest);
+        *dest = NULL;
+        *dest_len = 0;
+    }
+    return ret;
+}
+
+/**
+ * @brief: inflate in memory data from source onto the end of a growable
+ *         buffer, so that many streams can be decoded back to back into
+ *         one buffer without copying
+ * @param: buf U8** in/out, malloc'd buffer (NULL to start one), may be
+ *         moved by realloc(); caller frees, also on error
+ * @param: len U64* in/out, bytes of *buf in use, the inflated data is
+ *         written from here on and len advanced past it
+ * @param: cap U64* in/out, allocated size of *buf
+ * @param: source U8* source buffer, contains zlib data to be inflated
+ * @param: source_len U64 length of source data
+ * @param: expected_len U64 exact inflated length if known, 0 if unknown;
+ *         when short, the buffer doubles as needed
+ * @return =0  on success
+ *         <>0 error, *len is left as it was
+ */
+int mem_inf_append(U8 **buf, U64 *len, U64 *cap, U8 *source,
+                   U64 source_len, U64 expected_len)
+{
+    struct z_ctx *ctx = z_ctx_thread();
+    z_stream *strm;   /* pass info. to and from zlib routines   */
+    U64 want;         /* room wanted after *len                 */
+    U64 inf_len;      /* end of the inflated data in *buf       */
+    U64 in_left;      /* source bytes not yet handed to zlib    */
+    int ret = 0;      /* zlib return code                       */
+
+    /* one extra byte so that an exact expected_len is seen to be complete
+       without a second allocation */
+    want = (expected_len > 0) ? expected_len + 1 : 4 * source_len + CHUNK;
+    if (*cap - *len < want) {
+        U64 new_cap = *len + want;
+        U8 *p;
+
+        if (new_cap < *cap * 2 && expected_len == 0) {
+            new_cap = *cap * 2;
+        }
+        p = realloc(*buf, new_cap);
+        if (p == NULL) {
+            return Z_MEM_ERROR;
+        }
+        *buf = p;
+        *cap = new_cap;
+    }
+
+    ret = (ctx == NULL) ? Z_MEM_ERROR : z_ctx_inf(ctx);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm = &ctx->inf;
+    in_left = source_len;
+    strm->next_in = source;
+    inf_len = *len;
+
+    do {
+        U64 step = in_left < Z_STEP_MAX ? in_left : Z_STEP_MAX;
+
+        /* avail_in is 32 bits wide as well, input comes in steps too */
+        strm->avail_in += step;
+        in_left -= step;
+        if (inf_len == *cap) { /* out of room, grow geometrically */
+            U64 new_cap = *cap * 2;
+            U8 *p = realloc(*buf, new_cap);
+            if (p == NULL) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            *buf = p;
+            *cap = new_cap;
+        }
+        /* avail_out is 32 bits wide, feed very large buffers in steps */
+        strm->next_out = *buf + inf_len;
+        strm->avail_out = (*cap - inf_len > Z_STEP_MAX) ?
+                         Z_STEP_MAX : (unsigned) (*cap - inf_len);
+        ret = inflate(strm, Z_NO_FLUSH);
+        assert(ret != Z_STREAM_ERROR);
+        inf_len = strm->next_out - *buf;
+        if (ret == Z_NEED_DICT) {
+            ret = Z_DATA_ERROR;
+        }
+        if (ret == Z_BUF_ERROR && strm->avail_out != 0) {
+            ret = Z_DATA_ERROR; /* input ended before the stream did */
+        }
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+    if (ret != Z_STREAM_END) {
+        return (ret == Z_MEM_ERROR) ? Z_MEM_ERROR : Z_DATA_ERROR;
+    }
+    *len = inf_len;
+    return Z_OK;
+}
+
+/**
+ * @brief: inflate only the first *dest_len bytes of a zlib stream, e.g. to
+ *         look at the filter type of the first scanline without decoding
+ *         the whole image
+ * @param: dest U8* output buffer, at least *dest_len bytes
+ * @param: dest_len U64* in: bytes wanted, out: bytes actually inflated,
+ *         less than asked for only if the stream is that short
+ * @param: source U8* source buffer, contains zlib data
+ * @param: source_len U64 length of source data
+ * @return =0  on success
+ *         <>0 error
+ */
+int mem_inf_head(U8 *dest, U64 *dest_len, U8 *source, U64 source_len)
+{
+    struct z_ctx *ctx = z_ctx_thread();
+    z_stream *strm;
+    U64 in_left = source_len;   /* source bytes not yet handed to zlib */
+    U64 out_left = *dest_len;   /* room in dest not yet handed to zlib */
+    int ret;
+
+    ret = (ctx == NULL) ? Z_MEM_ERROR : z_ctx_inf(ctx);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm = &ctx->inf;
+    strm->next_in = source;
+    strm->next_out = dest;
+    strm->avail_out = 0;
+
+    /* in Z_STEP_MAX steps as in mem_inf(), until dest is full or the
+       stream or its input ends */
+    do {
+        U64 step;
+
+        step = in_left < Z_STEP_MAX ? in_left : Z_STEP_MAX;
+        strm->avail_in += step;
+        in_left -= step;
+        step = out_left < Z_STEP_MAX ? out_left : Z_STEP_MAX;
+        strm->avail_out += step;
+        out_left -= step;
+        ret = inflate(strm, Z_SYNC_FLUSH);
+        assert(ret != Z_STREAM_ERROR);
+    } while (ret == Z_OK && (strm->avail_out != 0 || out_left != 0));
+
+    *dest_len -= strm->avail_out + out_left;
+    if (ret == Z_STREAM_END || (ret == Z_OK && strm->avail_out == 0)) {
+        return Z_OK;
+    }
+    return (ret == Z_MEM_ERROR) ? Z_MEM_ERROR : Z_DATA_ERROR;
+}
+
+/******************************************************************************
+ * PARALLEL DEFLATE
+ * The input is cut into PDEF_SLICE byte slices, each compressed on its own
+ * as raw deflate data with the 32K of input before it as the preset
+ * dictionary, so matches can still reach back across the cut. Every slice
+ * but the last ends with Z_SYNC_FLUSH, which leaves it on a byte boundary,
+ * so the slices simply concatenate into one deflate stream. The zlib
+ * header goes in front and the Adler-32 of the whole input, combined from
+ * the per-slice checksums, behind. Slice boundaries do not depend on the
+ * number of threads, so neither does the output.
+ *****************************************************************************/
+
+/* one slice of a mem_def_parallel() job */
+struct pdef_slice {
+    U8 *out;          /* compressed slice, malloc'd by the worker  */
+    U64 out_len;      /* length of out                             */
+    uLong adler;      /* Adler-32 of the slice's input             */
+    int ret;          /* Z_OK or the zlib error                    */
+};
+
+/* work shared by the mem_def_parallel() threads */
+struct pdef_job {
+    U8 *source;
+    U64 source_len;
+    int level;
+    U64 nslices;
+    int nthreads;
+    struct pdef_slice *slices;
+};
+
+/* per thread argument: the job and the thread's index */
+struct pdef_worker {
+    struct pdef_job *job;
+    int id;
+};
+
+/* compress slice i of the job with the calling thread's raw stream */
+static int pdef_slice_run(struct pdef_job *job, U64 i)
+{
+    struct pdef_slice *sl = &job->slices[i];
+    U64 start = i * PDEF_SLICE;
+    U64 len = (start + PDEF_SLICE < job->source_len) ?
+              PDEF_SLICE : job->source_len - start;
+    int last = (i == job->nslices - 1);
+    struct z_ctx *ctx = z_ctx_thread();
+    z_stream *strm;
+    U64 cap;
+    int ret;
+
+    sl->out = NULL;
+    sl->out_len = 0;
+    sl->adler = adler32(adler32(0L, Z_NULL, 0), job->source + start, len);
+
+    ret = (ctx == NULL) ? Z_MEM_ERROR : z_ctx_raw(ctx, job->level);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm = &ctx->raw;
+    if (start > 0) {
+        U64 dict = start < 32768 ? start : 32768;
+        ret = deflateSetDictionary(strm, job->source + start - dict, dict);
+        if (ret != Z_OK) {
+            return ret;
+        }
+    }
+
+    cap = deflateBound(strm, len) + 16;
+    sl->out = malloc(cap);
+    if (sl->out == NULL) {
+        return Z_MEM_ERROR;
+    }
+    strm->next_in = job->source + start;
+    strm->avail_in = len;
+    strm->next_out = sl->out;
+    strm->avail_out = cap;
+    ret = deflate(strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((last && ret != Z_STREAM_END) || (!last && ret != Z_OK) ||
+        strm->avail_in != 0 || strm->avail_out == 0) {
+        return Z_BUF_ERROR;
+    }
+    sl->out_len = cap - strm->avail_out;
+    return Z_OK;
+}
+
+/* thread body, takes every nthreads-th slice starting at its index */
+static void *pdef_thread(void *arg)
+{
+    struct pdef_worker *w = arg;
+    struct pdef_job *job = w->job;
+    U64 i;
+
+    for (i = w->id; i < job->nslices; i += job->nthreads) {
+        job->slices[i].ret = pdef_slice_run(job, i);
+    }
+    return NULL;
+}
+
+/**
+ * @brief: deflate in memory data from source to dest on several threads
+ * @param: dest U8* output buffer, caller supplies, at least
+ *         mem_def_bound(source_len) bytes
+ * @param: dest_len, U64* output parameter, length of deflated data
+ * @param: source U8* source buffer, contains data to be deflated
+ * @param: source_len U64 length of source data
+ * @param: level int compression level, as for mem_def()
+ * @param: nthreads int number of threads, <= 0 for one per online CPU
+ * @return =0  on success 
+ *         <>0 on error
+ * NOTE: the output is a single valid zlib stream, identical for any
+ *       nthreads, but not byte identical to what mem_def() produces.
+ */
+int mem_def_parallel(U8 *dest, U64 *dest_len, U8 *source, U64 source_len,
+                     int level, int nthreads)
+{
+    struct pdef_job job;
+    struct pdef_worker *workers;
+    pthread_t *tids;
+    uLong adler;
+    U64 i, pos;
+    int started, t, ret = Z_OK;
+    unsigned int hdr;
+
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (int) ncpu : 1;
+    }
+    job.source = source;
+    job.source_len = source_len;
+    job.level = level;
+    job.nslices = source_len / PDEF_SLICE + (source_len % PDEF_SLICE != 0);
+    if (job.nslices == 0) {
+        job.nslices = 1; /* empty input still needs a final block */
+    }
+    if ((U64) nthreads > job.nslices) {
+        nthreads = (int) job.nslices;
+    }
+    job.nthreads = nthreads;
+    job.slices = calloc(job.nslices, sizeof(struct pdef_slice));
+    workers = malloc(nthreads * sizeof(struct pdef_worker));
+    tids = malloc(nthreads * sizeof(pthread_t));
+    if (job.slices == NULL || workers == NULL || tids == NULL) {
+        free(job.slices);
+        free(workers);
+        free(tids);
+        return Z_MEM_ERROR;
+    }
+
+    /* worker 0 is the calling thread; if a thread cannot be started the
+       caller does that thread's share too */
+    for (t = 0; t < nthreads; t++) {
+        workers[t].job = &job;
+        workers[t].id = t;
+    }
+    for (started = 1; started < nthreads; started++) {
+        if (pthread_create(&tids[started], NULL, pdef_thread,
+                           &workers[started]) != 0) {
+            break;
+        }
+    }
+    pdef_thread(&workers[0]);
+    for (t = started; t < nthreads; t++) {
+        pdef_thread(&workers[t]);
+    }
+    for (t = 1; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+
+    /* zlib header: deflate, 32K window, level hint, header check bits */
+    hdr = (0x78 << 8) | ((level == 1 ? 0 : (level >= 2 && level <= 5) ? 1 :
+                          (level == 6 || level == Z_DEFAULT_COMPRESSION) ?
+                          2 : 3) << 6);
+    hdr += 31 - hdr % 31;
+    dest[0] = hdr >> 8;
+    dest[1] = hdr & 0xff;
+    pos = 2;
+
+    adler = adler32(0L, Z_NULL, 0);
+    for (i = 0; i < job.nslices; i++) {
+        struct pdef_slice *sl = &job.slices[i];
+        U64 len = (i == job.nslices - 1) ?
+                  source_len - i * PDEF_SLICE : PDEF_SLICE;
+
+        if (sl->ret != Z_OK && ret == Z_OK) {
+            ret = sl->ret;
+        }
+        if (ret == Z_OK) {
+            memcpy(dest + pos, sl->out, sl->out_len);
+            pos += sl->out_len;
+            adler = adler32_combine(adler, sl->adler, len);
+        }
+        free(sl->out);
+    }
+    dest[pos++] = (adler >> 24) & 0xff;
+    dest[pos++] = (adler >> 16) & 0xff;
+    dest[pos++] = (adler >> 8) & 0xff;
+    dest[pos++] = adler & 0xff;
+
+    free(job.slices);
+    free(workers);
+    free(tids);
+    *dest_len = (ret == Z_OK) ? pos : 0;
+    return ret;
+}
+
+/******************************************************************************
+ * SPLICING ZLIB STREAMS
+ * Complete zlib streams are appended to one another without recompressing
+ * anything, the way zlib's examples/gzjoin.c joins gzip files. Each stream
+ * is walked block by block with inflate(Z_BLOCK) to find its last block,
+ * whose BFINAL bit is cleared; if the data then ends mid-byte it is padded
+ * to a byte boundary with empty blocks. z_join_end() closes the result with
+ * an empty final block and the Adler-32 of everything, combined from the
+ * Adler-32 of each piece.
+ * z_join_add_head() replaces the first few uncompressed bytes of a stream.
+ * Only the blocks up to the first block boundary a full 32K window past
+ * them are re-encoded, since no match after that point can reach back into
+ * the replaced bytes; the blocks from there on are spliced as they are,
+ * shifted to start on the byte boundary the re-encoded part ends on.
+ *****************************************************************************/
+
+/* what z_join_walk() found out about one zlib stream */
+struct z_join_walk {
+    U8 *start, *end;  /* its deflate data                           */
+    int end_bits;     /* unused bits in end[-1]                     */
+    U8 *last_byte;    /* the last block's BFINAL bit                */
+    int last_bit;
+    U8 *split_byte;   /* first bit spliced as it is, NULL if none   */
+    int split_bit;
+    U64 split_out;    /* uncompressed bytes before split_byte       */
+    U64 out_len;      /* uncompressed bytes in all                  */
+    uLong rest_adler; /* Adler-32 of the bytes from split_out on    */
+    U8 *pre;          /* the bytes before split_out, if asked for   */
+    U64 pre_cap;      /* allocated size of pre, caller frees it     */
+};
+
+/* keep n more inflated bytes in w->pre */
+static int z_join_keep(struct z_join_walk *w, const U8 *data, U64 n)
+{
+    U64 len = w->split_out;
+
+    if (len + n > w->pre_cap) {
+        U64 new_cap = w->pre_cap * 2 > len + n ? w->pre_cap * 2 : len + n;
+        U8 *p = realloc(w->pre, new_cap);
+        if (p == NULL) {
+            return Z_MEM_ERROR;
+        }
+        w->pre = p;
+        w->pre_cap = new_cap;
+    }
+    memcpy(w->pre + len, data, n);
+    w->split_out += n;
+    return Z_OK;
+}
+
+/**
+ * @brief: check a zlib stream and find its blocks
+ * @param: w struct z_join_walk* output, where things are in source
+ * @param: source U8* a complete zlib stream, without a preset dictionary
+ * @param: source_len U64 length of source
+ * @param: keep U64 0 to splice all of it, else split it at the first block
+ *         boundary 32K or more past the first keep uncompressed bytes and
+ *         keep the inflated bytes before that in w->pre
+ * @return =0  on success
+ *         <>0 error; w->pre is to be freed either way
+ * NOTE: the stream is fully inflated (to a scratch buffer) to find its
+ *       blocks and check its Adler-32, which costs far less than
+ *       deflating it again.
+ */
+static int z_join_walk(struct z_join_walk *w, U8 *source, U64 source_len,
+                       U64 keep)
+{
+    struct z_ctx *ctx = z_ctx_thread();
+    z_stream *strm;
+    U8 junk[CHUNK];
+    uLong adler = adler32(0L, Z_NULL, 0);
+    U8 *end;
+    U64 in_left;      /* deflate data not yet handed to zlib */
+    int bits, ret;
+
+    w->pre = NULL;
+    w->pre_cap = 0;
+    /* zlib header: deflate with a 32K window or less, no dictionary */
+    if (source_len < 2 + 4 || (source[0] & 0x0f) != Z_DEFLATED ||
+        (source[0] >> 4) > 7 || (source[1] & 0x20) != 0 ||
+        ((source[0] << 8) | source[1]) % 31 != 0) {
+        return Z_DATA_ERROR;
+    }
+    ret = (ctx == NULL) ? Z_MEM_ERROR : z_ctx_rinf(ctx);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm = &ctx->rinf;
+    w->start = source + 2;
+    strm->next_in = w->start;
+    in_left = source_len - 2 - 4;
+    w->last_byte = w->start;
+    w->last_bit = 0;
+    w->split_byte = (keep == 0) ? w->start : NULL;
+    w->split_bit = 0;
+    w->split_out = 0;
+    w->rest_adler = adler;
+
+    /* walk the blocks, keeping track of where the current one's header
+       starts, until inflate stops at the end of the last block */
+    for (;;) {
+        U64 n = in_left < Z_STEP_MAX ? in_left : Z_STEP_MAX;
+
+        /* avail_in is 32 bits wide, large streams go in steps */
+        strm->avail_in += n;
+        in_left -= n;
+        strm->next_out = junk;
+        strm->avail_out = CHUNK;
+        ret = inflate(strm, Z_BLOCK);
+        assert(ret != Z_STREAM_ERROR);
+        if (ret == Z_BUF_ERROR || ret == Z_STREAM_END) {
+            ret = Z_DATA_ERROR; /* ran out of input inside the stream */
+        }
+        if (ret != Z_OK) {
+            return (ret == Z_MEM_ERROR) ? Z_MEM_ERROR : Z_DATA_ERROR;
+        }
+        n = CHUNK - strm->avail_out;
+        adler = adler32(adler, junk, n);
+        if (w->split_byte == NULL) {
+            ret = z_join_keep(w, junk, n);
+            if (ret != Z_OK) {
+                return ret;
+            }
+        } else {
+            w->rest_adler = adler32(w->rest_adler, junk, n);
+        }
+        if ((strm->data_type & 128) == 0) {
+            continue;         /* still inside a block */
+        }
+        if (strm->data_type & 64) {
+            break;            /* that was the last block */
+        }
+        /* the next block header starts right after the bits used */
+        bits = strm->data_type & 7;
+        if (bits != 0) {
+            w->last_byte = strm->next_in - 1;
+            w->last_bit = 8 - bits;
+        } else {
+            if (strm->avail_in == 0 && in_left == 0) {
+                return Z_DATA_ERROR;
+            }
+            w->last_byte = strm->next_in;
+            w->last_bit = 0;
+        }
+        /* matches reach back 32K at most, none from here on can see
+           the kept bytes */
+        if (w->split_byte == NULL && strm->total_out >= keep + 32768) {
+            w->split_byte = w->last_byte;
+            w->split_bit = w->last_bit;
+        }
+    }
+    end = strm->next_in;
+    w->end = end;
+    w->end_bits = strm->data_type & 7;
+    w->out_len = strm->total_out;
+    if (end + 4 > source + source_len ||
+        adler != (((uLong) end[0] << 24) | ((uLong) end[1] << 16) |
+                  ((uLong) end[2] << 8) | end[3])) {
+        return Z_DATA_ERROR;
+    }
+    return Z_OK;
+}
+
+/* make room for len more bytes of deflate data after the zlib header,
+   plus the padding and the tail written by z_join_end() */
+static int z_join_room(struct z_join *zj, U64 len)
+{
+    U64 need = (zj->len == 0 ? 2 : zj->len) + len + 5 + 2 + 4;
+
+    if (need > zj->cap) {
+        U64 new_cap = zj->cap * 2 > need ? zj->cap * 2 : need;
+        U8 *p = realloc(zj->buf, new_cap);
+        if (p == NULL) {
+            return Z_MEM_ERROR;
+        }
+        zj->buf = p;
+        zj->cap = new_cap;
+    }
+    return Z_OK;
+}
+
+/* the first stream's zlib header goes in front, z_join_end() fixes up
+   its window size */
+static void z_join_start(struct z_join *zj, const U8 *source, int cinfo)
+{
+    if (zj->len == 0) {
+        zj->buf[0] = source[0];
+        zj->buf[1] = source[1];
+        zj->len = 2;
+    }
+    if (cinfo > zj->cinfo) {
+        zj->cinfo = cinfo;
+    }
+}
+
+/* append the deflate data of w from its split on, with the last block's
+   BFINAL bit cleared, and pad it out to a byte boundary; z_join_room()
+   made room for it */
+static void z_join_put(struct z_join *zj, const struct z_join_walk *w)
+{
+    U8 *from = w->split_byte;
+    U8 *dst = zj->buf + zj->len;
+    U64 n = w->end - from;
+    U64 nbits = n * 8 - w->split_bit - w->end_bits;
+    U64 i, g;
+    int bits;
+
+    if (w->split_bit == 0) {
+        memcpy(dst, from, n);
+    } else {
+        /* shift it down so it starts on a byte boundary */
+        for (i = 0; i < n; i++) {
+            dst[i] = from[i] >> w->split_bit;
+            if (i + 1 < n) {
+                dst[i] |= from[i + 1] << (8 - w->split_bit);
+            }
+        }
+    }
+    g = (w->last_byte - from) * 8 + w->last_bit - w->split_bit;
+    dst[g / 8] &= ~(1 << (g % 8));
+    zj->len += (nbits + 7) / 8;
+    bits = (8 - nbits % 8) % 8;
+
+    /* pad the last byte out with empty blocks: an empty stored block is
+       3 header bits then byte aligned LEN/NLEN, an empty fixed block is
+       10 bits, so either fills the remaining bits exactly */
+    if (bits != 0) {
+        U8 last = zj->buf[zj->len - 1] & ((0x100 >> bits) - 1);
+        U64 pos = zj->len;
+
+        if (bits & 1) {
+            zj->buf[pos - 1] = last;
+            if (bits == 1) {
+                zj->buf[pos++] = 0; /* 2 more header bits */
+            }
+            memcpy(zj->buf + pos, "\0\0\xff\xff", 4);
+            pos += 4;
+        } else {
+            pos--;
+            switch (bits) {
+            case 6:
+                zj->buf[pos++] = last | 8;
+                last = 0;
+                /* fall through */
+            case 4:
+                zj->buf[pos++] = last | 0x20;
+                last = 0;
+                /* fall through */
+            case 2:
+                zj->buf[pos++] = last | 0x80;
+                zj->buf[pos++] = 0;
+            }
+        }
+        zj->len = pos;
+    }
+}
+
+/**
+ * @brief: start an empty join
+ */
+void z_join_init(struct z_join *zj)
+{
+    zj->buf = NULL;
+    zj->len = 0;
+    zj->cap = 0;
+    zj->adler = adler32(0L, Z_NULL, 0);
+    zj->total_out = 0;
+    zj->cinfo = 0;
+}
+
+/**
+ * @brief: release the joined data
+ */
+void z_join_free(struct z_join *zj)
+{
+    free(zj->buf);
+    z_join_init(zj);
+}
+
+/**
+ * @brief: append a complete zlib stream to the join
+ * @param: zj struct z_join* the join
+ * @param: source U8* a complete zlib stream, without a preset dictionary
+ * @param: source_len U64 length of source
+ * @return =0  on success
+ *         <>0 error, zj is left as it was
+ */
+int z_join_add(struct z_join *zj, U8 *source, U64 source_len)
+{
+    struct z_join_walk w;
+    int ret;
+
+    ret = z_join_walk(&w, source, source_len, 0);
+    if (ret == Z_OK) {
+        ret = z_join_room(zj, w.end - w.start);
+    }
+    if (ret == Z_OK) {
+        z_join_start(zj, source, source[0] >> 4);
+        z_join_put(zj, &w);
+        zj->adler = adler32_combine(zj->adler, w.rest_adler, w.out_len);
+        zj->total_out += w.out_len;
+    }
+    free(w.pre);
+    return ret;
+}
+
+/**
+ * @brief: append a complete zlib stream to the join with its first
+ *         head_len uncompressed bytes replaced by head, re-encoding only
+ *         the blocks that have to be (see above)
+ * @param: zj struct z_join* the join
+ * @param: source U8* a complete zlib stream, without a preset dictionary
+ * @param: source_len U64 length of source
+ * @param: head const U8* the bytes to put in place of the first ones
+ * @param: head_len U64 length of head, no longer than the stream's data
+ * @param: level int compression level of the re-encoded blocks
+ * @return =0  on success
+ *         <>0 error, zj is left as it was
+ */
+int z_join_add_head(struct z_join *zj, U8 *source, U64 source_len,
+                    const U8 *head, U64 head_len, int level)
+{
+    struct z_ctx *ctx = z_ctx_thread();
+    struct z_join_walk w;
+    z_stream *strm = NULL;
+    U64 bound = 0, rest = 0;
+    U8 *dst;
+    int ret;
+
+    if (head_len == 0) {
+        return z_join_add(zj, source, source_len);
+    }
+    ret = z_join_walk(&w, source, source_len, head_len);
+    if (ret == Z_OK && w.out_len < head_len) {
+        ret = Z_DATA_ERROR;
+    }
+    /* the re-encoded part goes through deflate() in one call, it is the
+       head, 32K and a block or so, far below the 32 bit limit */
+    if (ret == Z_OK && w.split_out > Z_STEP_MAX) {
+        ret = Z_BUF_ERROR;
+    }
+    if (ret == Z_OK) {
+        ret = (ctx == NULL) ? Z_MEM_ERROR : z_ctx_raw(ctx, level);
+    }
+    if (ret == Z_OK) {
+        strm = &ctx->raw;
+        bound = deflateBound(strm, w.split_out) + 16;
+        rest = (w.split_byte != NULL) ? (U64) (w.end - w.split_byte) : 0;
+        ret = z_join_room(zj, bound + rest);
+    }
+    if (ret == Z_OK) {
+        /* the re-encoded part ends with Z_SYNC_FLUSH, on a byte boundary
+           and with no final block */
+        memcpy(w.pre, head, head_len);
+        dst = zj->buf + (zj->len == 0 ? 2 : zj->len);
+        strm->next_in = w.pre;
+        strm->avail_in = w.split_out;
+        strm->next_out = dst;
+        strm->avail_out = bound;
+        ret = deflate(strm, Z_SYNC_FLUSH);
+        if (ret != Z_OK || strm->avail_in != 0 || strm->avail_out == 0) {
+            ret = Z_BUF_ERROR;
+        }
+    }
+    if (ret == Z_OK) {
+        z_join_start(zj, source, MAX_WBITS - 8);
+        zj->len += bound - strm->avail_out;
+        zj->adler = adler32_combine(zj->adler,
+                                    adler32(adler32(0L, Z_NULL, 0), w.pre,
+                                            w.split_out), w.split_out);
+        zj->total_out += w.split_out;
+        if (w.split_byte != NULL) {
+            z_join_put(zj, &w);
+            zj->adler = adler32_combine(zj->adler, w.rest_adler,
+                                        w.out_len - w.split_out);
+            zj->total_out += w.out_len - w.split_out;
+        }
+    }
+    free(w.pre);
+    return ret;
+}
+
+/**
+ * @brief: finish the join so that zj->buf holds a complete zlib stream
+ * @param: zj struct z_join* the join, at least one stream added
+ * @param: dest_len U64* output parameter, length of the zlib stream
+ * @return =0  on success
+ *         <>0 error
+ * NOTE: the tail goes after zj->len without moving it, so more streams
+ *       can still be added afterwards (and the join ended again).
+ */
+int z_join_end(struct z_join *zj, U64 *dest_len)
+{
+    U8 *p;
+    unsigned head;
+
+    if (zj->len == 0) {
+        return Z_STREAM_ERROR;
+    }
+    /* the header declares the largest window of any stream added, with
+       the first one's FLEVEL, and FCHECK made up for it */
+    head = ((zj->cinfo << 4 | Z_DEFLATED) << 8) | (zj->buf[1] & 0xc0);
+    head += 31 - head % 31;
+    zj->buf[0] = head >> 8;
+    zj->buf[1] = head & 0xff;
+
+    /* an empty fixed block with BFINAL set, then the trailer */
+    p = zj->buf + zj->len;
+    p[0] = 0x03;
+    p[1] = 0x00;
+    p[2] = (zj->adler >> 24) & 0xff;
+    p[3] = (zj->adler >> 16) & 0xff;
+    p[4] = (zj->adler >> 8) & 0xff;
+    p[5] = zj->adler & 0xff;
+    *dest_len = zj->len + 6;
+    return Z_OK;
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
@@ -22,12 +22,59 @@
 #endif
 
 #define CHUNK 16384  /* =256*64 on the order of 128K or 256K should be used */
+#define Z_STEP_MAX 0x40000000UL /* most bytes handed to zlib per call, 1G */
+#define PDEF_SLICE (128 * 1024)  /* input bytes per mem_def_parallel() slice */
 
 /* TYPEDEFS */
 typedef unsigned char U8;
 typedef unsigned long int U64;
 
+/* reusable deflate and inflate state, one per thread (see zutil.c) */
+typedef struct z_ctx {
+    z_stream def;     /* deflate stream, valid if def_ready     */
+    int def_ready;
+    int def_level;    /* compression level def was set up with  */
+    z_stream raw;     /* raw deflate stream for mem_def_parallel() */
+    int raw_ready;
+    int raw_level;
+    z_stream inf;     /* inflate stream, valid if inf_ready     */
+    int inf_ready;
+    z_stream rinf;    /* raw inflate stream for z_join_add()    */
+    int rinf_ready;
+} *z_ctx_p;
+
+/* a zlib stream built by splicing complete zlib streams end to end */
+typedef struct z_join {
+    U8 *buf;          /* zlib header and the spliced deflate data */
+    U64 len;          /* bytes of buf in use, not counting the tail */
+    U64 cap;          /* allocated size of buf                    */
+    uLong adler;      /* Adler-32 of all the uncompressed data    */
+    U64 total_out;    /* uncompressed bytes so far                */
+    int cinfo;        /* largest window (CINFO) of the streams added */
+} *z_join_p;
+
 /* FUNCTION PROTOTYPES */
 int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level);
 int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
+U64 mem_def_bound(U64 source_len);
+int mem_inf_alloc(U8 **dest, U64 *dest_len, U8 *source, U64 source_len,
+                  U64 expected_len);
+int mem_inf_append(U8 **buf, U64 *len, U64 *cap, U8 *source,
+                   U64 source_len, U64 expected_len);
 void zerr(int ret);
+void z_ctx_init(struct z_ctx *ctx);
+void z_ctx_free(struct z_ctx *ctx);
+struct z_ctx *z_ctx_thread(void);
+int mem_def_ctx(struct z_ctx *ctx, U8 *dest, U64 *dest_len, U8 *source,
+                U64 source_len, int level);
+int mem_inf_ctx(struct z_ctx *ctx, U8 *dest, U64 *dest_len, U8 *source,
+                U64 source_len);
+int mem_def_parallel(U8 *dest, U64 *dest_len, U8 *source, U64 source_len,
+                     int level, int nthreads);
+int mem_inf_head(U8 *dest, U64 *dest_len, U8 *source, U64 source_len);
+void z_join_init(struct z_join *zj);
+int z_join_add(struct z_join *zj, U8 *source, U64 source_len);
+int z_join_add_head(struct z_join *zj, U8 *source, U64 source_len,
+                    const U8 *head, U64 head_len, int level);
+int z_join_end(struct z_join *zj, U64 *dest_len);
+void z_join_free(struct z_join *zj);
@@ -35,6 +35,8 @@
 #include "lab_png.h"
 #include "crc.h"
 #include "zutil.h"
+#include "arena.h"
+#include "png_filter.h"
 #include <semaphore.h>
 
 #define IMG_URL "http://ece252-"
@@ -68,13 +70,16 @@ int numDownloaded = 0;
 int isFilled[50];
 struct simple_PNG strips[50];
 struct data_IHDR ihdr_strips[50];
+struct arena g_stripArena[50]; //everything a stored strip owns, freed by buildPng()
+int g_raw = 0; //-x: write output.raw, the pixels unfiltered and uncompressed, instead of output.png
 int getInfo(CURL *, CURLcode, RECV_BUF, char *);
 int *cURLstart(char *);
-int isStored(int);
-void init_iHDR(struct data_IHDR *, char *, struct simple_PNG *);
-void init_iDAT(data_IHDR_p, char *, simple_PNG_p, int *);
-void init_iEND(data_IHDR_p, char *, simple_PNG_p);
+int claimStrip(int);
+int init_iHDR(struct data_IHDR *, char *, size_t, struct simple_PNG *);
+int init_iDAT(data_IHDR_p, const struct png_view *, simple_PNG_p, int *);
+int init_iEND(data_IHDR_p, const struct png_view *, simple_PNG_p);
 void buildPng();
+void buildRaw();
 sem_t mutex;
 sem_t mutexNumD;
 
@@ -189,7 +194,7 @@ int getOpt(char **argv, int *t, int *n, int argc)
 	int c;
 	char *str = "option requires an argument";
 
-	while ((c = getopt(argc, argv, "t:n:")) != -1) {
+	while ((c = getopt(argc, argv, "t:n:x")) != -1) {
 		switch (c) {
 		case 't':
 			*t = strtoul(optarg, NULL, 10);
@@ -207,6 +212,9 @@ int getOpt(char **argv, int *t, int *n, int argc)
 				return -1;
 			}
 			break;
+		case 'x':
+			g_raw = 1;
+			break;
 		default:
 			return -1;
 		}
@@ -230,43 +238,39 @@ int main( int argc, char** argv )
 		printf("Bad use of arguments, exiting...\n");
 		return -1;
 	}
-	pthread_t *p_tids = malloc(sizeof(pthread_t) * t);
+	//the thread ids and URLs live until every thread is joined, then go together
+	struct arena args;
+	arena_init(&args, 0);
+	pthread_t *p_tids = arena_alloc(&args, sizeof(pthread_t) * t);
+	if (p_tids == NULL) {
+		perror("malloc");
+		return -1;
+	}
 	//int numConnection = (t <= 3) ? t : 3; // will distribute thread connection as equally as possible on servers
-    U8 **url = malloc(t*((URL_LEN + sizeof(int)) * sizeof(U8)));
-	memset(url, 0, t*((URL_LEN + sizeof(int)) * sizeof(U8)));
 	//building all the URLs
 	for (int i = 0; i < t; i++) {
-		url[i] = malloc((URL_LEN + sizeof(int)) * sizeof(U8));
-		memset(url[i], 0, (URL_LEN + sizeof(int)) * sizeof(U8));
-		strcpy(url[i], IMG_URL);
-		char *int_serv;
-		int_serv = malloc(sizeof(int));
-		sprintf(int_serv, "%d", i % 3 + 1);
-		url[i] = concatenation(concatenation(url[i], 14, int_serv, 1), 15, IMG_URL2, URL_LEN - 15);
-		char *int_img;
-		int_img = malloc(sizeof(int));
-		sprintf(int_img, "%d", n);
-		url[i] = concatenation(url[i], URL_LEN, int_img, 1);
-		//printf("URL is %s\n", url[i]);
-		pthread_create(p_tids + i, NULL, cURLstart, url[i]);
-		//cURLstart(url[i]);
-		free(int_serv);
-		free(int_img);
+		char *url = arena_alloc(&args, URL_LEN + 8);
+		if (url == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		snprintf(url, URL_LEN + 8, "%s%d%s%d", IMG_URL, i % 3 + 1, IMG_URL2, n);
+		//printf("URL is %s\n", url);
+		pthread_create(p_tids + i, NULL, cURLstart, url);
+		//cURLstart(url);
 	}
 	for (int i = 0; i < t; i++) {
 		pthread_join(p_tids[i], NULL);
 	}
 	sem_destroy(&mutex);
 	sem_destroy(&mutexNumD);
-	//free (url);	
-	free(p_tids);
+	arena_release(&args);
 	buildPng();
 	return 0;
 }
 
 U8* concatenation(const U8 *s1, const U32 size_s1, const U8 *s2, const U32 size_s2) {
 	U8 *con = malloc(size_s1 + size_s2); /*length of s1 + length of s2 + \0 + "/" since it's added between the concatenations*/
-	memset(con, 0, size_s1 + size_s2);
 	memcpy(con, s1, size_s1);
 	memcpy(con + size_s1, s2, size_s2);
 #if 0
@@ -301,12 +305,13 @@ int *cURLstart(char *url) {
 	curl_global_cleanup();
 	//recv_buf_cleanup(&recv_buf);
 	//printf("think the error is the line before this print statement\n");
-	free(url);
+	//url belongs to main()
 }
 
 int getInfo(CURL *curl_handle, CURLcode res, RECV_BUF recv_buf, char *url)
 {
 	if (numDownloaded == 50) {
+		recv_buf_cleanup(&recv_buf);
 		return 0;
 	}
 	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
@@ -334,14 +339,21 @@ int getInfo(CURL *curl_handle, CURLcode res, RECV_BUF recv_buf, char *url)
 			recv_buf.size, recv_buf.buf, recv_buf.seq);
 	}
 	int sequence = recv_buf.seq;
-	//isStored returns 0 if already have current strip
-	if (!isStored(sequence)) {
-		isFilled[sequence] = 1;
-		init_iHDR(&(ihdr_strips[sequence]), recv_buf.buf, &(strips[sequence]));
-		//printf("Finished inserting sequence %d\n", sequence);
-		sem_wait(&mutexNumD);
-		numDownloaded++;
-		sem_post(&mutexNumD);
+	//claimStrip returns 0 if already have current strip (or another thread is storing it)
+	if (sequence >= 0 && sequence < 50 && claimStrip(sequence)) {
+		if (init_iHDR(&(ihdr_strips[sequence]), recv_buf.buf, recv_buf.size, &(strips[sequence])) != 0) {
+			//corrupted strip, let it be downloaded again
+			fprintf(stderr, "strip %d is corrupt (bad CRC or data), refetching\n", sequence);
+			sem_wait(&mutex);
+			isFilled[sequence] = 0;
+			sem_post(&mutex);
+		}
+		else {
+			//printf("Finished inserting sequence %d\n", sequence);
+			sem_wait(&mutexNumD);
+			numDownloaded++;
+			sem_post(&mutexNumD);
+		}
 	}
 	recv_buf_cleanup(&recv_buf);
 	recv_buf_init(&recv_buf, BUF_SIZE);
@@ -355,286 +367,170 @@ int getInfo(CURL *curl_handle, CURLcode res, RECV_BUF recv_buf, char *url)
 	getInfo(curl_handle, res, recv_buf, url);
 }
 
-int isStored(int inc)
+int claimStrip(int inc)
 {
+	//checked and marked in one go, so only one thread ever stores a strip
 	sem_wait(&mutex);
-	int ret = isFilled[inc];
+	int ret = !isFilled[inc];
+	isFilled[inc] = 1;
 	sem_post(&mutex);
-	// if true, then sequence has already been downloaded
+	// if false, then sequence has already been downloaded
 	return ret;
 }
 
 
 
-void init_iHDR(struct data_IHDR *test_iHDR, char *png_buf, struct simple_PNG *test) {
-	U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
-	int inc = 0;
-#if 0
-	for (int i = 0; i < 37; i++) {
-		printf("%02X ", *(png_buf + i));
+int init_iHDR(struct data_IHDR *test_iHDR, char *png_buf, size_t png_size, struct simple_PNG *test) {
+	struct png_view pv;   /* where the strip's chunks are in png_buf, no copies */
+	int totalHeight;
+
+	//one pass over the strip, checking every CRC; nothing but the pixels
+	//is kept from a strip so ancillary chunks are left out
+	if (png_view_parse(&pv, (U8 *) png_buf, png_size, PNG_VIEW_SKIP_ANCILLARY) != 0) {
+		return -1;
 	}
-	printf("\n");
-#endif
-	//mallocing all the required info
-	int *totalHeight = malloc(sizeof(int));
-	test->p_IHDR = malloc(sizeof(struct chunk));
-	memset(test->p_IHDR, 0, sizeof(struct chunk));
-	test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	memset(test->p_IHDR->p_data, 0, DATA_IHDR_SIZE);
-	test->p_IHDR->length = DATA_IHDR_SIZE;
-	test->p_IDAT = malloc(sizeof(struct chunk));
-	memset(test->p_IDAT, 0, sizeof(struct chunk));
-	test->p_IDAT->length = 0;
-	test->p_IDAT->p_data = malloc(1);
-	test->p_IDAT->p_data[0] = '\0';
-	test->p_IEND = malloc(sizeof(struct chunk));
-	memset(test->p_IEND, 0, sizeof(struct chunk));
-	
-	
-	/* Step 1: Initialize some data in a buffer */
-	/* Step 1.1: Allocate a dynamic buffer */
-	p_buffer = malloc(PNG_SIG_SIZE + 1);
-	memset(p_buffer, 0, PNG_SIG_SIZE + 1);
-	memcpy(p_buffer, png_buf + inc, PNG_SIG_SIZE);
-	inc += PNG_SIG_SIZE;
-	p_buffer[PNG_SIG_SIZE] = '\0';
-	free(p_buffer);
-
-	p_buffer = malloc(CHUNK_LEN_SIZE); //get length of data
-	memset(p_buffer, 0, CHUNK_LEN_SIZE);
-	memcpy(p_buffer, png_buf + inc, CHUNK_LEN_SIZE);
-	inc += CHUNK_LEN_SIZE;
-
-	U32 length_ihdr;
-
-	memcpy(&length_ihdr, p_buffer, CHUNK_LEN_SIZE);
-	length_ihdr = htonl(length_ihdr);
-	//printf("%08X\n", length_ihdr);
-	test->p_IHDR->length = length_ihdr;
-	//test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	//test->p_IHDR->length = DATA_IHDR_SIZE;
-	free(p_buffer);
-	p_buffer = malloc(CHUNK_TYPE_SIZE);
-	memset(p_buffer, 0, CHUNK_TYPE_SIZE);
-	memcpy(p_buffer, png_buf + inc, CHUNK_TYPE_SIZE);
-	inc += CHUNK_TYPE_SIZE;
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		test->p_IHDR->type[i] = *(p_buffer + i)&0xFF;
-		//printf("%02X", test->p_IHDR->type[i]);
-	}
-	//printf("\n");
-	free(p_buffer);
-	p_buffer = malloc(test->p_IHDR->length);
-	memset(p_buffer, 0, test->p_IHDR->length);
-	memcpy(p_buffer, png_buf + inc, length_ihdr);
-	//printf("p_data: ");
-	for (int i = 0; i < test->p_IHDR->length; i++) {
-		*(test->p_IHDR->p_data + i) = *(p_buffer + i);
-		//printf("%02X", *(p_buffer + i));
-	}
-	//printf("\n");
-	inc += length_ihdr;
-	inc += CHUNK_CRC_SIZE; 
-	free(p_buffer);
+	//the IHDR fields are read where they are; the strip keeps only its IDAT
+	const U8 *ihdr = pv.buf + pv.chunks[0].offset;
 
 	int incrementation = 0;
 
 	//doing width
-	memcpy(&test_iHDR->width, test->p_IHDR->p_data, sizeof(test_iHDR->width));
-	for (int i = 0; i < sizeof(test_iHDR->width); i++) {
-		//printf("%02X\n", *(test->p_IHDR->p_data + i));
-	}
-	
+	memcpy(&test_iHDR->width, ihdr, sizeof(test_iHDR->width));
 	incrementation += sizeof(test_iHDR->width);
 	test_iHDR->width = htonl(test_iHDR->width);
 	//printf("Width: %08X\n", test_iHDR->width);
 	
 	//doing height
-	memcpy(&test_iHDR->height, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->height));
-	test_iHDR->height = htonl(test_iHDR->height);
-	*(totalHeight) = test_iHDR->height;
-	//test_iHDR->height = *(totalHeight); //updating max height
-	test_iHDR->height = htonl(test_iHDR->height);
-	memcpy(test->p_IHDR->p_data + incrementation, &test_iHDR->height, sizeof(test_iHDR->height));
+	memcpy(&test_iHDR->height, ihdr + incrementation, sizeof(test_iHDR->height));
 	test_iHDR->height = htonl(test_iHDR->height);
+	totalHeight = test_iHDR->height;
 	incrementation += sizeof(test_iHDR->height);
 	//printf("height: %08X\n", test_iHDR->height);
 
 	//doing	bit depth
-	memcpy(&test_iHDR->bit_depth, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->bit_depth));
+	memcpy(&test_iHDR->bit_depth, ihdr + incrementation, sizeof(test_iHDR->bit_depth));
 	incrementation += sizeof(test_iHDR->bit_depth);
-	//test_iHDR->bit_depth = htonl(test_iHDR->height);
 	//printf("bit depth: %08X\n", test_iHDR->bit_depth);
 
-
 	//doing color type
-	memcpy(&test_iHDR->color_type, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->color_type));
+	memcpy(&test_iHDR->color_type, ihdr + incrementation, sizeof(test_iHDR->color_type));
 	incrementation += sizeof(test_iHDR->color_type);
-	//test_iHDR->color_type = htonl(test_iHDR->color_type);
 	//printf("color type: %08X\n", test_iHDR->color_type);
 
-
 	//doing compression
-	memcpy(&test_iHDR->compression, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->compression));
+	memcpy(&test_iHDR->compression, ihdr + incrementation, sizeof(test_iHDR->compression));
 	incrementation += sizeof(test_iHDR->compression);
-	//test_iHDR->compression = htonl(test_iHDR->compression);
 	//printf("compression: %08X\n", test_iHDR->compression);
 
-
 	//doing filter
-	memcpy(&test_iHDR->filter, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->filter));
+	memcpy(&test_iHDR->filter, ihdr + incrementation, sizeof(test_iHDR->filter));
 	incrementation += sizeof(test_iHDR->filter);
-	//test_iHDR->filter = htonl(test_iHDR->filter);
 	//printf("filter: %08X\n", test_iHDR->filter);
 
-
 	//doing interlace
-	memcpy(&test_iHDR->interlace, test->p_IHDR->p_data + incrementation, sizeof(test_iHDR->interlace));
+	memcpy(&test_iHDR->interlace, ihdr + incrementation, sizeof(test_iHDR->interlace));
 	incrementation += sizeof(test_iHDR->interlace);
-	//test_iHDR->interlace = htonl(test_iHDR->interlace);
 	//printf("interlace: %08X\n", test_iHDR->interlace);
-#if 0
-	printf("upcoming data is: ");
-	for (int i = 1; i <= 4; i++) {
-		printf("%02X", *(png_buf + inc + i));
-	}
-#endif
-	init_iDAT(test_iHDR, png_buf + inc, test, totalHeight);
-	free(totalHeight);
+
+	return init_iDAT(test_iHDR, &pv, test, &totalHeight);
 }
 
-void init_iDAT(data_IHDR_p test_iHDR, char *png_buf, simple_PNG_p test, int *totalHeight)
+int init_iDAT(data_IHDR_p test_iHDR, const struct png_view *pv, simple_PNG_p test, int *totalHeight)
 {
-#if 0
-	printf("incoming data is ");
-	for (int i = 1; i < 5; i++) {
-		printf("%02X", *(png_buf + i));
-	}
-#endif
-	U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
 	int ret = 0;          /* return value for various routines             */
-	int inc = 0;
-
-	p_buffer = malloc(CHUNK_LEN_SIZE); //get length of data
-	memset(p_buffer, 0, CHUNK_LEN_SIZE);
 
-	memcpy(p_buffer, png_buf + inc, CHUNK_LEN_SIZE);
-	inc += CHUNK_LEN_SIZE;
-
-	U32 chuck_length;
-	memcpy(&chuck_length, p_buffer, CHUNK_LEN_SIZE);
-	chuck_length = htonl(chuck_length);
-
-	test->p_IDAT->length = chuck_length;
-	//simple_PNG_p test = malloc(sizeof(struct simple_PNG));
+	//a strip has no palette, any other critical chunk means it's not one of ours
+	if (pv->idat != 1 || pv->nchunks != 3) {
+		return -1;
+	}
 
-	//test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	//test->p_IHDR->length = DATA_IHDR_SIZE;
-	free(p_buffer);
-	p_buffer = malloc(sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memset(p_buffer, 0, sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memcpy(p_buffer, png_buf + inc, sizeof(U8) * CHUNK_TYPE_SIZE);
-	inc += sizeof(U8) * CHUNK_TYPE_SIZE;
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		test->p_IDAT->type[i] = *(p_buffer + i);
-	}
-
-	free(p_buffer);
-	p_buffer = malloc(chuck_length);
-	memset(p_buffer, 0, chuck_length);
-	//printf("chuck length: %08X\n", chuck_length);
-	memcpy(p_buffer, png_buf + inc, chuck_length);
-	inc += chuck_length;
-	//printf("Size of p_buffer: %02X\n", sizeof(p_buffer));
-	//p_buffer[chuck_length] = '\0';
-	//printf("Chuck length of: %02X\n\n\n", chuck_length);
-	//printf("p_buffer data: \n")
-	U8 *inflated = malloc((test_iHDR->width * 4 + 1)*test_iHDR->height);
-	memset(inflated, 0, (test_iHDR->width * 4 + 1)*test_iHDR->height);
-	U64 lengthInf = 0;
-	U64 lengthCur = 0;
+	//the IHDR gives the exact size of the scanlines, however many IDAT
+	//chunks the server splits them over; they are inflated straight from
+	//the received data
+	U64 lengthCur = png_stride(test_iHDR) * *totalHeight;
 	U64 deflateLength = 0;
-	U8 *currData = malloc((test_iHDR->width * 4 + 1) * *(totalHeight));
-
-	memset(currData, 0, (test_iHDR->width * 4 + 1) * *(totalHeight));
+	if (lengthCur == 0) {
+		return -1;
+	}
 
-	ret = mem_inf(currData, &lengthCur, p_buffer, chuck_length);
-	free(p_buffer);
-	//ret = mem_inf(gp_buf_inf, &len_inf, gp_buf_def, len_def);
-	if (ret != 0) { /* failure */
-		fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
+	//one block holds all of the strip's memory: its scanlines, their
+	//deflated copy (not with -x) and the chunk header, released together
+	struct arena *a = &g_stripArena[test - strips];
+	U64 deflateBound = g_raw ? 0 : mem_def_bound(lengthCur);
+	arena_init(a, lengthCur + deflateBound + sizeof(struct chunk) + 3 * ARENA_ALIGN);
+	U8 *currData = arena_alloc(a, lengthCur);
+	U8 *deflated_data = g_raw ? currData : arena_alloc(a, deflateBound);
+	test->p_IDAT = arena_calloc(a, sizeof(struct chunk));
+
+	if (currData == NULL || deflated_data == NULL || test->p_IDAT == NULL || png_view_inflate_idat(pv, currData, lengthCur) != 0) { /* failure */
+		fprintf(stderr, "inflating the strip's IDAT chunks failed\n");
+		arena_release(a);
+		test->p_IDAT = NULL;
+		return -1;
+	}
+	if (g_raw) {
+		//each download thread unfilters its own strip, which starts over
+		//from a zero row; buildRaw() only has to write the strips out
+		if (png_unfilter(currData, *totalHeight, test_iHDR) != 0) {
+			fprintf(stderr, "bad filter type in the strip\n");
+			arena_release(a);
+			test->p_IDAT = NULL;
+			return -1;
+		}
+		memcpy(test->p_IDAT->type, "IDAT", CHUNK_TYPE_SIZE);
+		test->p_IDAT->p_data = currData;
+		test->p_IDAT->length = png_pack_rows(currData, *totalHeight, test_iHDR);
+		return init_iEND(test_iHDR, pv, test);
+	}
+	//below the top strip the row above this strip's first row is no longer
+	//all zeros, so that row can't be filtered against it
+	if (test != &strips[0] && png_detach_first_row(currData, test_iHDR) != 0) {
+		fprintf(stderr, "bad filter type in the strip\n");
+		arena_release(a);
+		test->p_IDAT = NULL;
+		return -1;
 	}
-	U8 *new_data;
-	new_data = malloc(lengthCur);
-	new_data = currData;
 
-	free(test->p_IDAT->p_data);
-	U8 *deflated_data = malloc((test_iHDR->width * 4 + 1)*test_iHDR->height);
-	ret = mem_def(deflated_data, &deflateLength, new_data, lengthCur + lengthInf, Z_DEFAULT_COMPRESSION);
-	//ret = mem_def(deflated_data, deflateLength, new_data, lengthCur + lengthInf, -1);
-	//    ret = mem_def(gp_buf_def, &len_def, p_buffer, BUF_LEN, Z_DEFAULT_COMPRESSION);
+	ret = mem_def(deflated_data, &deflateLength, currData, lengthCur, Z_DEFAULT_COMPRESSION);
 	if (ret != 0) { /* failure */
 		fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
+		arena_release(a);
+		test->p_IDAT = NULL;
 		return ret;
 	}
+	//the only data a strip owns: the one chunk buildPng() takes apart
+	memcpy(test->p_IDAT->type, "IDAT", CHUNK_TYPE_SIZE);
 	test->p_IDAT->p_data = deflated_data;
 	test->p_IDAT->length = deflateLength;
 
-	inc += CHUNK_CRC_SIZE;
-
-	init_iEND(test_iHDR, png_buf + inc, test);
+	return init_iEND(test_iHDR, pv, test);
 }
 
-void init_iEND(data_IHDR_p test_iHDR, char *png_buf, simple_PNG_p test) {
-	U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
-	int inc = 0;
-	p_buffer = malloc(CHUNK_LEN_SIZE); //get length of data
-	memset(p_buffer, 0, CHUNK_LEN_SIZE);
-
-	memcpy(p_buffer, png_buf + inc, CHUNK_LEN_SIZE);
-	inc += CHUNK_LEN_SIZE;
-
-	U32 chuck_length;
-	memcpy(&chuck_length, p_buffer, CHUNK_LEN_SIZE);
-	chuck_length = htonl(chuck_length);
-	test->p_IEND->length = chuck_length;
-	//simple_PNG_p test = malloc(sizeof(struct simple_PNG));
-
-	//test->p_IHDR->p_data = malloc(DATA_IHDR_SIZE);
-	//test->p_IHDR->length = DATA_IHDR_SIZE;
-	free(p_buffer);
-	p_buffer = malloc(sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memset(p_buffer, 0, sizeof(U8) * CHUNK_TYPE_SIZE + 1);
-	memcpy(p_buffer, png_buf + inc, sizeof(U8) * CHUNK_TYPE_SIZE);
-	inc += sizeof(U8) * CHUNK_TYPE_SIZE;
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		test->p_IEND->type[i] = *(p_buffer + i);
-	}
-	free(p_buffer);
-	p_buffer = malloc(chuck_length + 1);
-	memset(p_buffer, 0, chuck_length);
-	memcpy(p_buffer, png_buf + inc, chuck_length);
-	inc += chuck_length;
-	p_buffer[chuck_length] = '\0';
-	test->p_IEND->p_data = p_buffer;
-	memcpy(p_buffer, png_buf + inc, CHUNK_CRC_SIZE);
-	inc += CHUNK_CRC_SIZE;
-	memcpy(&chuck_length, p_buffer, CHUNK_CRC_SIZE);
-	chuck_length = htonl(chuck_length);
-	test->p_IEND->crc = chuck_length;
-	free(p_buffer);
+int init_iEND(data_IHDR_p test_iHDR, const struct png_view *pv, simple_PNG_p test) {
+	//png_view_parse() already found IEND last, with a good CRC; IHDR and
+	//IEND are the same for every strip and buildPng() writes its own
+	test->p_IHDR = NULL;
+	test->p_IEND = NULL;
+	return 0;
 }
 
 void buildPng()
 {
+	if (g_raw) {
+		buildRaw();
+		return;
+	}
 	struct simple_PNG final_png;
 	struct data_IHDR final_iHDR;
-	final_png.p_IHDR = malloc(sizeof(struct chunk));
-	final_png.p_IDAT = malloc(sizeof(struct chunk));
-	final_png.p_IEND = malloc(sizeof(struct chunk));
-	memset(final_png.p_IHDR, 0, sizeof(struct chunk));
-	memset(final_png.p_IDAT, 0, sizeof(struct chunk));
-	memset(final_png.p_IEND, 0, sizeof(struct chunk));
+	struct arena hdrs;    /* the output's chunk headers */
+	arena_init(&hdrs, 0);
+	final_png.p_IHDR = arena_calloc(&hdrs, sizeof(struct chunk));
+	final_png.p_IDAT = arena_calloc(&hdrs, sizeof(struct chunk));
+	final_png.p_IEND = arena_calloc(&hdrs, sizeof(struct chunk));
+	if (final_png.p_IHDR == NULL || final_png.p_IDAT == NULL || final_png.p_IEND == NULL) {
+		perror("malloc");
+		return;
+	}
 	
 	//Doing iHDR info for final PNG
 	U32 totHeight = 0;
@@ -649,27 +545,12 @@ void buildPng()
 	final_iHDR.filter = ihdr_strips[0].filter;
 	final_iHDR.interlace = ihdr_strips[0].interlace;
 	final_png.p_IHDR->length = htonl(DATA_IHDR_SIZE);
-	for (int i = 0; i < CHUNK_LEN_SIZE; i++) {
-		final_png.p_IHDR->type[i] = strips[0].p_IHDR->type[i];
-	}
-	U8 *temp_buffer = malloc(sizeof(U8)*DATA_IHDR_SIZE);
-	memcpy(temp_buffer, &final_iHDR.width, DATA_IHDR_SIZE);
+	memcpy(final_png.p_IHDR->type, "IHDR", CHUNK_TYPE_SIZE);
 #if 0
 	for (int i = 0; i < DATA_IHDR_SIZE; i++) {
-		printf("%02X ", *(temp_buffer + i));
+		printf("%02X ", *((U8 *)&final_iHDR.width + i));
 	}
 #endif
-	U8 *crc_buffer = malloc(sizeof(U8)*DATA_IHDR_SIZE + CHUNK_LEN_SIZE);
-	memcpy(crc_buffer, &final_png.p_IHDR->type, CHUNK_LEN_SIZE);
-	memcpy(crc_buffer + CHUNK_LEN_SIZE, temp_buffer, DATA_IHDR_SIZE);
-	
-	//printf("\n");
-	unsigned int crc_return;
-	crc_return = crc(crc_buffer, DATA_IHDR_SIZE + CHUNK_TYPE_SIZE);
-	//printf("%08X\n", crc_return);
-	final_png.p_IHDR->crc = htonl(crc_return);
-	free(temp_buffer);
-	free(crc_buffer);
 	//Final iDATA info for final PNG
 	int ret = 0;          /* return value for various routines             */
 	U64 len_def = 0;      /* compressed data length                        */
@@ -680,58 +561,42 @@ void buildPng()
 	}
 	for (int i = 0; i < 50; i++) {
 		//printf("beginning of for loop - %d\n", i);
-		U8 *inflated = malloc((final_iHDR.width * 4 + 1)*final_iHDR.height);
-		memset(inflated, 0, (final_iHDR.width * 4 + 1)*final_iHDR.height);
+		//output buffers are sized by zutil from the actual data, no guessing
+		U8 *inflated = NULL;
+		U8 *currData = NULL;
 		U64 lengthInf = 0;
 		U64 lengthCur = 0;
 		U64 deflateLength = 0;
-		U8 *currData = malloc((ihdr_strips[i].width * 4 + 1) * (ihdr_strips[i].height));
-
-		memset(currData, 0, (ihdr_strips[i].width * 4 + 1) * (ihdr_strips[i].height));
 
 		if (isFirst == 0) {
-			ret = mem_inf(inflated, &lengthInf, final_png.p_IDAT->p_data, final_png.p_IDAT->length);
-			if (ret == 0) { /* success */
-				//printf("original len = %d, len_def = %lu, len_inf = %lu\n", \
-					chuck_length, len_def, lengthCur);
-			}
-			else { /* failure */
-				fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
+			ret = mem_inf_alloc(&inflated, &lengthInf, final_png.p_IDAT->p_data, final_png.p_IDAT->length, 0);
+			if (ret != 0) { /* failure */
+				fprintf(stderr, "mem_inf failed. ret = %d.\n", ret);
+				return;
 			}
 		}
 		
-		ret = mem_inf(currData, &lengthCur, strips[i].p_IDAT->p_data, strips[i].p_IDAT->length);
-		//ret = mem_inf(gp_buf_inf, &len_inf, gp_buf_def, len_def);
-		if (ret == 0) { /* success */
-			//printf("original len = %d, len_def = %lu, len_inf = %lu\n", \
-				chuck_length, len_def, lengthCur);
-		}
-		else { /* failure */
-			fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
+		ret = mem_inf_alloc(&currData, &lengthCur, strips[i].p_IDAT->p_data, strips[i].p_IDAT->length, 0);
+		if (ret != 0) { /* failure */
+			fprintf(stderr, "mem_inf failed. ret = %d.\n", ret);
+			return;
 		}
 		U8 *new_data;
 		if (isFirst == 1) {
-			new_data;
 			new_data = currData;
 		}
 		else
 		{
-			new_data;
 			new_data = concatenation(inflated, lengthInf, currData, lengthCur);
+			free(currData);
 		}
 		free(inflated);
-		//free(currData);
 		free(final_png.p_IDAT->p_data);
-		U8 *deflated_data = malloc((final_iHDR.width * 4 + 1)*final_iHDR.height);
+		U8 *deflated_data = malloc(mem_def_bound(lengthCur + lengthInf));
 		ret = mem_def(deflated_data, &deflateLength, new_data, lengthCur + lengthInf, Z_DEFAULT_COMPRESSION);
-		//ret = mem_def(deflated_data, deflateLength, new_data, lengthCur + lengthInf, -1);
-		//    ret = mem_def(gp_buf_def, &len_def, p_buffer, BUF_LEN, Z_DEFAULT_COMPRESSION);
-		if (ret == 0) { /* success */
-		   //printf("original len = %d, len_def = %lu\n", lengthCur + lengthInf, deflateLength);
-		}
-		else { /* failure */
+		if (ret != 0) { /* failure */
 			fprintf(stderr, "mem_def failed. ret = %d.\n", ret);
-			return ret;
+			return;
 		}
 		final_png.p_IDAT->p_data = deflated_data;
 		final_png.p_IDAT->length = deflateLength;
@@ -740,35 +605,72 @@ void buildPng()
 	}
 
 	//printf("bananas3");
-	crc_return = crc(concatenation(&final_png.p_IDAT->type, CHUNK_TYPE_SIZE, final_png.p_IDAT->p_data, final_png.p_IDAT->length), CHUNK_TYPE_SIZE + final_png.p_IDAT->length);
-	final_png.p_IDAT->crc = htonl(crc_return);
 	//final_png.p_IDAT->length = htonl(final_png.p_IDAT->length);
-	final_png.p_IEND->length = strips[0].p_IEND->length;
-	for (int i = 0; i < CHUNK_TYPE_SIZE; i++) {
-		final_png.p_IEND->type[i] = strips[i].p_IEND->type[i];
-	}
-	final_png.p_IEND->crc = htonl(strips[0].p_IEND->crc);
+	final_png.p_IEND->length = 0;
+	memcpy(final_png.p_IEND->type, "IEND", CHUNK_TYPE_SIZE);
 	
 
-	FILE *concatenated_png;
-	concatenated_png = fopen("output.png", "wb");
-	final_png.p_IDAT->length = htonl(final_png.p_IDAT->length);
-	unsigned char png_definition[] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, '\0' };
-	fwrite(&png_definition, PNG_SIG_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IHDR->length, CHUNK_LEN_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IHDR->type, CHUNK_TYPE_SIZE, 1, concatenated_png);
-	fwrite(&final_iHDR.width,  DATA_IHDR_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IHDR->crc, CHUNK_CRC_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IDAT->length, CHUNK_LEN_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IDAT->type, CHUNK_TYPE_SIZE, 1, concatenated_png);
-	fwrite(final_png.p_IDAT->p_data, htonl(final_png.p_IDAT->length), 1, concatenated_png);
-	fwrite(&final_png.p_IDAT->crc, CHUNK_CRC_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IEND->length, CHUNK_LEN_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IEND->type, CHUNK_TYPE_SIZE, 1, concatenated_png);
-	fwrite(&final_png.p_IEND->crc, CHUNK_CRC_SIZE, 1, concatenated_png);
+	//the chunks are queued in place with their headers and CRCs and
+	//png_out_close() writes the whole file in one go
+	struct png_out concatenated_png;
+	if (png_out_open(&concatenated_png, "output.png") != 0) {
+		perror("output.png");
+		return;
+	}
+	//queuing stops at the first chunk that fails, and no half-built
+	//output.png is left behind
+	ret = png_out_sig(&concatenated_png);
+	if (ret == 0) {
+		ret = png_out_chunk(&concatenated_png, final_png.p_IHDR->type, (U8 *)&final_iHDR.width, DATA_IHDR_SIZE);
+	}
+	concatenated_png.nthreads = 0; //large IDATs get their CRC computed on all cores
+	if (ret == 0) {
+		ret = png_out_chunk(&concatenated_png, final_png.p_IDAT->type, final_png.p_IDAT->p_data, final_png.p_IDAT->length);
+	}
+	concatenated_png.nthreads = 1;
+	if (ret == 0) {
+		ret = png_out_chunk(&concatenated_png, final_png.p_IEND->type, NULL, final_png.p_IEND->length);
+	}
+	if (ret != 0) {
+		perror("output.png");
+		png_out_close(&concatenated_png);
+		unlink("output.png");
+	}
+	else if (png_out_close(&concatenated_png) != 0) {
+		perror("output.png");
+	}
 	free(final_png.p_IDAT->p_data);
-	free(final_png.p_IHDR);
-	free(final_png.p_IDAT);
-	free(final_png.p_IEND);
-	fclose(concatenated_png);
+	arena_release(&hdrs);
+	//every strip's memory, one release each
+	for (int i = 0; i < 50; i++) {
+		arena_release(&g_stripArena[i]);
+		strips[i].p_IDAT = NULL;
+	}
+}
+
+//-x: the strips hold their pixels already unfiltered and packed, so the
+//output is a header and then each strip's pixels as they are, one pwritev()
+void buildRaw()
+{
+	struct data_IHDR final_iHDR = ihdr_strips[0];
+	final_iHDR.height = 0;
+	for (int i = 0; i < 50; i++) {
+		final_iHDR.height += ihdr_strips[i].height;
+	}
+	struct png_out raw;
+	if (png_out_open(&raw, "output.raw") != 0) {
+		perror("output.raw");
+		return;
+	}
+	int ret = png_out_raw_header(&raw, &final_iHDR, 0);
+	for (int i = 0; i < 50 && ret == 0; i++) {
+		ret = png_out_data(&raw, strips[i].p_IDAT->p_data, strips[i].p_IDAT->length);
+	}
+	if (png_out_close(&raw) != 0 || ret != 0) {
+		perror("output.raw");
+	}
+	for (int i = 0; i < 50; i++) {
+		arena_release(&g_stripArena[i]);
+		strips[i].p_IDAT = NULL;
+	}
 }